@@ -0,0 +1,393 @@
+#define TESTING
+#include "project.cpp"
+
+#include <iomanip>
+#include <sstream>
+#include <tbb/global_control.h>
+
+struct BenchConfig
+{
+    int warmup = 2;        // untimed runs before measuring
+    int repetitions = 15;  // timed runs per benchmark
+    std::string csvFile;   // also write every row here, empty = off
+};
+
+struct Timings
+{
+    double median = 0;
+    double p95 = 0;
+    double p99 = 0;
+};
+
+// runs fn config.warmup times untimed, then config.repetitions times timed; nearest-rank percentiles in milliseconds
+auto measure = [](const BenchConfig &config, const std::function<size_t()> &fn)
+{
+    size_t sink = 0;
+    for (int i = 0; i < config.warmup; ++i)
+    {
+        sink += fn();
+    }
+
+    std::vector<double> times;
+    for (int i = 0; i < config.repetitions; ++i)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        sink += fn();
+        auto end = std::chrono::high_resolution_clock::now();
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    static volatile size_t keepAlive = 0; // results must not be optimized away
+    keepAlive = keepAlive + sink;
+
+    const auto percentile = [&times](double p)
+    { return times[static_cast<size_t>(std::ceil(p * times.size())) - 1]; };
+    return Timings{percentile(0.5), percentile(0.95), percentile(0.99)};
+};
+
+// prints one table per section and mirrors every row into the CSV file
+class Report
+{
+public:
+    explicit Report(const std::string &csvFile)
+    {
+        if (!csvFile.empty())
+        {
+            csv.open(csvFile);
+            failed = !csv;
+            csv << "section,benchmark,median_ms,p95_ms,p99_ms,mb_per_s,mtokens_per_s\n";
+        }
+    }
+
+    bool csvFailed() const { return failed; }
+
+    void section(const std::string &title)
+    {
+        current = title;
+        std::cout << "\n"
+                  << std::left << std::setw(44) << title << std::right << std::setw(10) << "median" << std::setw(10) << "p95" << std::setw(10) << "p99"
+                  << std::setw(10) << "MB/s" << std::setw(12) << "Mtokens/s" << "\n";
+    }
+
+    // bytes and tokens are the input of one run; 0 leaves that throughput column empty
+    void add(const std::string &name, const Timings &timings, size_t bytes, size_t tokens)
+    {
+        // millions per second, or the placeholder when there is nothing to divide
+        const auto rate = [&timings](size_t amount, int precision, const std::string &placeholder)
+        {
+            std::ostringstream text;
+            text << std::fixed << std::setprecision(precision);
+            if (amount == 0)
+            {
+                return placeholder;
+            }
+            text << amount / timings.median / 1000.0;
+            return text.str();
+        };
+        std::cout << std::left << std::setw(44) << name << std::right << std::fixed << std::setprecision(3) << std::setw(10) << timings.median
+                  << std::setw(10) << timings.p95 << std::setw(10) << timings.p99 << std::setw(10) << rate(bytes, 1, "-") << std::setw(12)
+                  << rate(tokens, 1, "-") << "\n";
+
+        if (csv.is_open())
+        {
+            csv << "\"" << current << "\",\"" << name << "\"," << std::fixed << std::setprecision(4) << timings.median << "," << timings.p95 << "," << timings.p99 << ","
+                << rate(bytes, 4, "") << "," << rate(tokens, 4, "") << "\n";
+        }
+    }
+
+private:
+    std::ofstream csv;
+    bool failed = false;
+    std::string current;
+};
+
+auto parseBenchArgs = [](const std::vector<std::string> &args) -> Result<BenchConfig>
+{
+    BenchConfig config;
+    for (const auto &arg : args)
+    {
+        const auto name = arg.substr(0, arg.find('=') + 1);
+        const auto value = arg.substr(name.size());
+        if (name == "--csv=" && !value.empty())
+        {
+            config.csvFile = value;
+        }
+        else if ((name == "--warmup=" || name == "--repetitions=") && !value.empty() && value.size() < 7 &&
+                 value.find_first_not_of("0123456789") == std::string::npos)
+        {
+            (name == "--warmup=" ? config.warmup : config.repetitions) = std::stoi(value);
+        }
+        else
+        {
+            return "Unknown or invalid option: " + arg + " (use --csv=FILE, --warmup=N, --repetitions=N)";
+        }
+    }
+    if (config.repetitions == 0)
+    {
+        return std::string("--repetitions must be at least 1");
+    }
+    return config;
+};
+
+int main(int argc, char *argv[])
+{
+    const auto parsedConfig = parseBenchArgs(std::vector<std::string>(argv + 1, argv + argc));
+    if (auto err = std::get_if<std::string>(&parsedConfig))
+    {
+        std::cerr << "Error: " << *err << std::endl;
+        return 1;
+    }
+    const auto config = std::get<BenchConfig>(parsedConfig);
+
+    const auto book = readFile("files/war_and_peace.txt");
+    const auto warTerms = readFile("files/war_terms.txt");
+    const auto peaceTerms = readFile("files/peace_terms.txt");
+    if (std::holds_alternative<std::string>(book) || std::holds_alternative<std::string>(warTerms) || std::holds_alternative<std::string>(peaceTerms))
+    {
+        std::cerr << "Error: benchmark input files not found" << std::endl;
+        return 1;
+    }
+
+    const auto &lines = std::get<std::vector<std::string>>(book);
+    const auto tokens = tokenizeAll(lines);
+    const auto warTokens = tokenizeAll(std::get<std::vector<std::string>>(warTerms));
+    const auto peaceTokens = tokenizeAll(std::get<std::vector<std::string>>(peaceTerms));
+    const auto lineBytes = std::accumulate(lines.begin(), lines.end(), size_t{0}, [](size_t sum, const std::string &line)
+                                           { return sum + line.size(); });
+    const auto tokenBytes = std::accumulate(tokens.begin(), tokens.end(), size_t{0}, [](size_t sum, const std::string &token)
+                                            { return sum + token.size(); });
+
+    Report report(config.csvFile);
+    if (report.csvFailed())
+    {
+        std::cerr << "Error: cannot write CSV file " << config.csvFile << std::endl;
+        return 1;
+    }
+
+    std::cout << "War and Peace: " << tokens.size() << " tokens, " << std::fixed << std::setprecision(2) << lineBytes / 1e6 << " MB of text; " << config.warmup
+              << " warmup + " << config.repetitions << " timed runs per row, times in ms, throughput from the median\n";
+
+    // the chapter pipeline stage by stage, each on the whole book
+    report.section("Pipeline stages");
+    report.add("tokenize (views, every line)", measure(config, [&]()
+                                                       {
+                                                           size_t words = 0; // characters, so every word is built
+                                                           for (const auto &line : lines)
+                                                           {
+                                                               for (const auto &word : tokenize(line))
+                                                               {
+                                                                   words += word.size();
+                                                               }
+                                                           }
+                                                           return words; }),
+               lineBytes, tokens.size());
+    report.add("tokenizeAll", measure(config, [&]()
+                                      { return tokenizeAll(lines).size(); }),
+               lineBytes, tokens.size());
+    report.add("filterWords (war terms)", measure(config, [&]()
+                                                  { return filterWords(tokens, warTokens).size(); }),
+               tokenBytes, tokens.size());
+    report.add("countOccurrences", measure(config, [&]()
+                                           { return countOccurrences(tokens).size(); }),
+               tokenBytes, tokens.size());
+    const auto warOccurrences = countOccurrences(filterWords(tokens, warTokens));
+    report.add("calculateDensity (sums the term counts)", measure(config, [&]()
+                                                                  { return static_cast<size_t>(calculateDensity(tokens, warOccurrences) * 1e9); }),
+               0, 0);
+    report.add("processChapters", measure(config, [&]()
+                                          { return processChapters(tokens, warTokens, peaceTokens).first.size(); }),
+               tokenBytes, tokens.size());
+    const auto densities = processChapters(tokens, warTokens, peaceTokens);
+    const auto categorizations = categorizeChapters(densities.first, densities.second);
+    const std::string linesFile = "files/output/benchLines.txt";
+    auto *const coutBuffer = std::cout.rdbuf(nullptr); // writeLines reports every file it saves
+    const auto writeTimings = measure(config, [&]()
+                                      { return writeLines(categorizations, linesFile).index(); });
+    std::cout.rdbuf(coutBuffer);
+    std::cout.clear();
+    const auto writtenBytes = std::filesystem::exists(linesFile) ? static_cast<size_t>(std::filesystem::file_size(linesFile)) : 0;
+    std::remove(linesFile.c_str());
+    report.add("writeLines (" + std::to_string(categorizations.size()) + " chapters)", writeTimings, writtenBytes, 0);
+
+    report.section("Hash maps");
+    report.add("count: unordered_map", measure(config, [&]()
+                                               {
+                                                   std::unordered_map<std::string, int> count;
+                                                   for (const auto &token : tokens)
+                                                   {
+                                                       count[token]++;
+                                                   }
+                                                   return count.size(); }),
+               tokenBytes, tokens.size());
+
+    report.add("count: FlatStringMap", measure(config, [&]()
+                                               {
+                                                   FlatStringMap<int> count;
+                                                   for (const auto &token : tokens)
+                                                   {
+                                                       count[token]++;
+                                                   }
+                                                   return count.size(); }),
+               tokenBytes, tokens.size());
+
+    const auto interned = internTokens(tokens);
+    report.add("count: dense ids", measure(config, [&]()
+                                           { return countIdOccurrences(interned.ids, interned.vocabulary.size()).size(); }),
+               0, tokens.size());
+
+    std::unordered_map<std::string, int> unorderedTerms;
+    FlatStringMap<int> flatTerms;
+    for (const auto &term : warTokens)
+    {
+        unorderedTerms[term] = 1;
+        flatTerms[term] = 1;
+    }
+
+    report.add("term lookup: unordered_map", measure(config, [&]()
+                                                     { return static_cast<size_t>(std::count_if(tokens.begin(), tokens.end(), [&](const std::string &token)
+                                                                                                { return unorderedTerms.find(token) != unorderedTerms.end(); })); }),
+               tokenBytes, tokens.size());
+
+    report.add("term lookup: FlatStringMap", measure(config, [&]()
+                                                     { return static_cast<size_t>(std::count_if(tokens.begin(), tokens.end(), [&](const std::string &token)
+                                                                                                { return flatTerms.find(token) != nullptr; })); }),
+               tokenBytes, tokens.size());
+
+    report.section("Hit index (tokens column: queries)");
+    const auto categories = classifyVocabulary(interned.vocabulary, warTokens, {}, MatchMode::Exact);
+    report.add("hit index: build", measure(config, [&]()
+                                           { return HitIndex(interned.ids, categories).size(); }),
+               0, tokens.size());
+
+    const HitIndex index(interned.ids, categories);
+    const size_t queries = 1000000;
+    report.add("hit index: 1M range queries", measure(config, [&]()
+                                                      {
+                                                          size_t hits = 0;
+                                                          uint64_t state = 42;
+                                                          for (size_t q = 0; q < queries; ++q)
+                                                          {
+                                                              state = mixHash(state);
+                                                              const auto a = state % index.size();
+                                                              const auto b = a + (state >> 32) % (index.size() - a + 1);
+                                                              hits += index.hits(WAR, a, b);
+                                                          }
+                                                          return hits; }),
+               0, queries);
+
+    // speedup curve of the two-phase chapter scoring (boundary index, then parallel_for into slots)
+    report.section("Thread scaling (speedup over 1 thread)");
+    const auto markerCategories = classifyVocabulary(interned.vocabulary, warTokens, {}, MatchMode::Exact);
+    double singleThread = 0;
+    for (const size_t threads : {1, 2, 4, 8, 16, 32, 64})
+    {
+        tbb::global_control limit(tbb::global_control::max_allowed_parallelism, threads);
+        const auto timings = measure(config, [&]()
+                                     { return scoreChapters(interned.ids, markerCategories).first.size(); });
+        singleThread = threads == 1 ? timings.median : singleThread;
+        std::ostringstream name;
+        name << "score chapters: " << threads << " threads (" << std::fixed << std::setprecision(2) << singleThread / timings.median << "x)";
+        report.add(name.str(), timings, 0, tokens.size());
+    }
+    // full-vocabulary counting: the string hashing of the partition tables is what spreads over the threads
+    for (const size_t threads : {1, 2, 4, 8, 16, 32, 64})
+    {
+        tbb::global_control limit(tbb::global_control::max_allowed_parallelism, threads);
+        const auto timings = measure(config, [&]()
+                                     { return countOccurrences(tokens).size(); });
+        singleThread = threads == 1 ? timings.median : singleThread;
+        std::ostringstream name;
+        name << "count occurrences: " << threads << " threads (" << std::fixed << std::setprecision(2) << singleThread / timings.median << "x)";
+        report.add(name.str(), timings, 0, tokens.size());
+    }
+
+    // even split vs longest-first, with the load imbalance (max / mean worker busy time) of the last run
+    report.section("Schedules (load imbalance)");
+    const auto chapterRanges = chapterIndex(interned.ids, markerCategories);
+    for (const int workers : {4, 16})
+    {
+        tbb::task_arena arena(workers);
+        for (const auto &[schedule, scheduleName] : std::vector<std::pair<Schedule, std::string>>{{Schedule::Even, "even"}, {Schedule::LongestFirst, "longest"}})
+        {
+            double imbalance = 0;
+            const auto timings = measure(config, [&, schedule = schedule]()
+                                         {
+                                             const auto scheduled = arena.execute([&]
+                                                                                  { return scoreChaptersScheduled(interned.ids, markerCategories, chapterRanges, schedule); });
+                                             imbalance = scheduled.imbalance();
+                                             return scheduled.chapters.size(); });
+            std::ostringstream name;
+            name << "schedule " << scheduleName << ": " << workers << " workers (" << std::fixed << std::setprecision(2) << imbalance << ")";
+            report.add(name.str(), timings, 0, tokens.size());
+        }
+    }
+
+    const auto bookBytes = readWholeFile("files/war_and_peace.txt");
+    if (const auto *bytes = std::get_if<std::vector<char>>(&bookBytes))
+    {
+        report.section("Paragraphs");
+        const TermClassifier classifier(warTokens, {}, MatchMode::Exact);
+        size_t paragraphs = 0;
+        const auto timings = measure(config, [&]()
+                                     { return paragraphs = scoreParagraphs(std::string_view(bytes->data(), bytes->size()), classifier).size(); });
+        report.add("paragraphs: " + std::to_string(paragraphs) + " units", timings, bytes->size(), tokens.size());
+    }
+
+    // every policy-driven stage under each execution mode
+    report.section("Execution policies");
+    const auto stageCategories = classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, MatchMode::Exact);
+    const auto stageDensities = scoreChapters(interned.ids, stageCategories);
+    const std::vector<std::pair<ExecMode, std::string>> modes = {{ExecMode::Seq, "seq"}, {ExecMode::Par, "par"}, {ExecMode::ParUnseq, "par_unseq"}};
+    for (const auto &[exec, modeName] : modes)
+    {
+        report.add("tokenize: " + modeName, measure(config, [&, exec = exec]()
+                                                    { return tokenizeAll(lines, exec).size(); }),
+                   lineBytes, tokens.size());
+    }
+    for (const auto &[exec, modeName] : modes)
+    {
+        report.add("classify (stem, vocabulary words): " + modeName, measure(config, [&, exec = exec]()
+                                                                              { return classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, MatchMode::Stem, exec).size(); }),
+                   0, interned.vocabulary.size());
+    }
+    for (const auto &[exec, modeName] : modes)
+    {
+        report.add("count chapters: " + modeName, measure(config, [&, exec = exec]()
+                                                          { return scoreChapters(interned.ids, stageCategories, DensityMode::Ratio, exec).first.size(); }),
+                   0, tokens.size());
+    }
+    for (const auto &[exec, modeName] : modes)
+    {
+        report.add("categorize (chapters): " + modeName, measure(config, [&, exec = exec]()
+                                                                 { return categorizeChapters(stageDensities.first, stageDensities.second, exec).size(); }),
+                   0, stageDensities.first.size());
+    }
+
+    // the chunked scorer on synthetic corpora of growing size (default generator settings, seed 1)
+    report.section("Scaling (synthetic corpus, chunked scorer)");
+    auto terms = warTokens;
+    terms.insert(terms.end(), peaceTokens.begin(), peaceTokens.end());
+    const CorpusConfig corpusConfig;
+    const CorpusGenerator generator(corpusConfig, syntheticVocabulary(corpusConfig.vocabulary, corpusConfig.seed, terms), terms);
+    const TermClassifier corpusClassifier(warTokens, peaceTokens, MatchMode::Exact);
+    for (const uint64_t megabytes : {10, 20, 40})
+    {
+        std::ostringstream corpus;
+        generateCorpus(generator, megabytes * 1000000, corpus);
+        const auto text = corpus.str();
+        size_t corpusTokens = 0;
+        const auto timings = measure(config, [&]()
+                                     {
+                                         const auto chapters = scoreChunked(text, corpusClassifier, 1 << 20);
+                                         corpusTokens = std::accumulate(chapters.begin(), chapters.end(), size_t{0}, [](size_t sum, const ChapterCounts &chapter)
+                                                                        { return sum + chapter.words; });
+                                         return chapters.size(); });
+        report.add("scoreChunked: " + std::to_string(megabytes) + " MB", timings, text.size(), corpusTokens);
+    }
+
+    if (!config.csvFile.empty())
+    {
+        std::cout << "\nResults saved to '" << config.csvFile << "'" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,152 @@
+#define TESTING
+#include "project.cpp"
+
+#include <iomanip>
+
+struct GenerateOptions
+{
+    uint64_t bytes = 10'000'000;
+    CorpusConfig corpus;
+    std::string sampleFile; // draw the vocabulary from this text's most frequent words, empty = synthetic words
+    std::string outputFile = "files/output/corpus.txt";
+};
+
+// 10M, 1.5G, 100G: decimal units, as file sizes are usually given
+auto parseByteCount = [](const std::string &value) -> std::optional<uint64_t>
+{
+    const std::string units = "KMGT";
+    const auto unit = value.empty() ? std::string::npos : units.find(value.back());
+    const auto number = unit == std::string::npos ? value : value.substr(0, value.size() - 1);
+    if (number.empty() || number.find_first_not_of("0123456789.") != std::string::npos || std::count(number.begin(), number.end(), '.') > 1 ||
+        number == ".")
+    {
+        return std::nullopt;
+    }
+    const auto bytes = std::stod(number) * std::pow(1000.0, unit == std::string::npos ? 0 : unit + 1);
+    return bytes >= 1 && bytes < 1e18 ? std::optional<uint64_t>(static_cast<uint64_t>(bytes)) : std::nullopt;
+};
+
+auto parseGenerateOptions = [](const std::vector<std::string> &args) -> Result<GenerateOptions>
+{
+    GenerateOptions options;
+    const std::vector<std::pair<std::string, size_t *>> counts = {
+        {"--vocabulary=", &options.corpus.vocabulary}, {"--chapters-per-book=", &options.corpus.chaptersPerBook}, {"--paragraph-words=", &options.corpus.paragraphWords}};
+    const std::vector<std::pair<std::string, double *>> decimals = {
+        {"--zipf=", &options.corpus.zipf}, {"--term-rate=", &options.corpus.termRate}, {"--chapter-words=", &options.corpus.chapterWords},
+        {"--chapter-spread=", &options.corpus.chapterSpread}};
+    for (const auto &arg : args)
+    {
+        const auto name = arg.substr(0, arg.find('=') + 1);
+        const auto value = arg.substr(name.size());
+        const auto isNumber = !value.empty() && value.size() < 19 && value.find_first_not_of("0123456789") == std::string::npos;
+        const auto isDecimal = !value.empty() && value.size() < 19 && value.find_first_not_of("0123456789.") == std::string::npos &&
+                               std::count(value.begin(), value.end(), '.') <= 1 && value != ".";
+        const auto count = std::find_if(counts.begin(), counts.end(), [&name](const auto &option)
+                                        { return option.first == name; });
+        const auto decimal = std::find_if(decimals.begin(), decimals.end(), [&name](const auto &option)
+                                          { return option.first == name; });
+
+        if (arg == "--sample")
+        {
+            options.sampleFile = "files/war_and_peace.txt";
+        }
+        else if (name == "--bytes=" && parseByteCount(value))
+        {
+            options.bytes = *parseByteCount(value);
+        }
+        else if ((name == "--sample=" || name == "--output=") && !value.empty())
+        {
+            (name == "--sample=" ? options.sampleFile : options.outputFile) = value;
+        }
+        else if (name == "--seed=" && isNumber)
+        {
+            options.corpus.seed = std::stoull(value);
+        }
+        else if (count != counts.end() && isNumber)
+        {
+            *count->second = std::stoull(value);
+        }
+        else if (decimal != decimals.end() && isDecimal)
+        {
+            *decimal->second = std::stod(value);
+        }
+        else
+        {
+            return "Unknown or invalid option: " + arg;
+        }
+    }
+    if (options.corpus.vocabulary == 0 || options.corpus.termRate > 1 || options.corpus.chapterWords < 1 || options.corpus.chapterSpread > 5)
+    {
+        return std::string("--vocabulary must be at least 1, --term-rate at most 1, --chapter-words at least 1 and --chapter-spread at most 5");
+    }
+    return options;
+};
+
+int main(int argc, char *argv[])
+{
+    auto startTime = std::chrono::high_resolution_clock::now();
+    try
+    {
+        const auto parsedOptions = parseGenerateOptions(std::vector<std::string>(argv + 1, argv + argc));
+        if (auto err = std::get_if<std::string>(&parsedOptions))
+        {
+            throw std::runtime_error(*err);
+        }
+        const auto options = std::get<GenerateOptions>(parsedOptions);
+
+        auto warTerms = readFile("files/war_terms.txt");
+        auto peaceTerms = readFile("files/peace_terms.txt");
+        if (auto err = std::get_if<std::string>(&warTerms))
+        {
+            throw std::runtime_error(*err);
+        }
+        else if (auto err = std::get_if<std::string>(&peaceTerms))
+        {
+            throw std::runtime_error(*err);
+        }
+        auto terms = tokenizeAll(std::get<std::vector<std::string>>(warTerms));
+        const auto peaceTokens = tokenizeAll(std::get<std::vector<std::string>>(peaceTerms));
+        terms.insert(terms.end(), peaceTokens.begin(), peaceTokens.end());
+        terms.erase(std::remove(terms.begin(), terms.end(), std::string()), terms.end());
+
+        std::vector<std::string> vocabulary;
+        if (options.sampleFile.empty())
+        {
+            vocabulary = syntheticVocabulary(options.corpus.vocabulary, options.corpus.seed, terms);
+        }
+        else
+        {
+            auto sample = readFile(options.sampleFile);
+            if (auto err = std::get_if<std::string>(&sample))
+            {
+                throw std::runtime_error(*err);
+            }
+            vocabulary = rankedVocabulary(tokenizeAll(std::get<std::vector<std::string>>(sample), ExecMode::Par), options.corpus.vocabulary, terms);
+        }
+
+        std::ofstream out(options.outputFile, std::ios::binary);
+        if (!out)
+        {
+            throw std::runtime_error("Error opening output file: " + options.outputFile);
+        }
+        const auto vocabularySize = vocabulary.size();
+        const CorpusGenerator generator(options.corpus, std::move(vocabulary), terms);
+        const auto generated = generateCorpus(generator, options.bytes, out);
+        if (auto err = std::get_if<std::string>(&generated))
+        {
+            throw std::runtime_error(*err);
+        }
+        const auto &stats = std::get<CorpusStats>(generated);
+
+        const auto seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+        std::cout << "Generated " << stats.bytes << " bytes, " << stats.chapters << " chapters, " << vocabularySize << " filler words"
+                  << (options.sampleFile.empty() ? "" : " from '" + options.sampleFile + "'") << " to '" << options.outputFile << "' in " << std::fixed
+                  << std::setprecision(2) << seconds << " s (" << std::setprecision(1) << stats.bytes / seconds / 1e6 << " MB/s)" << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
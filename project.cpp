@@ -5,12 +5,50 @@
 #include <functional>
 #include <numeric>
 #include <fstream>
+#include <iomanip>
 #include <iterator>
 #include <algorithm>
 #include <chrono>
 #include <range/v3/all.hpp>
 #include <execution>
 #include <variant>
+#include <optional>
+#include <array>
+#include <filesystem>
+#include <unordered_map>
+#include <cstdint>
+#include <cctype>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <cmath>
+#include <ctime>
+#include <limits>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_scan.h>
+#include <tbb/parallel_pipeline.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+#include <tbb/task_scheduler_observer.h>
+#include <tbb/global_control.h>
+#include <tbb/info.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <atomic>
+#include <stdexcept>
+#include <new>
+#include <cstdlib>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__linux__)
+#include <sched.h>
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
 // #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 // #include "doctest.h"
 
@@ -23,246 +61,3556 @@ using Result = std::variant<T, std::string>;
 
 using Success = std::monostate; // stateless, single-value state
 
+// execution policy of the parallel-algorithm stages, chosen at runtime (par and par_unseq run on the TBB backend)
+enum class ExecMode
+{
+    Seq,
+    Par,
+    ParUnseq
+};
+
+// calls fn with the standard execution policy object that matches mode
+template <typename F>
+auto withPolicy(ExecMode mode, F &&fn)
+{
+    switch (mode)
+    {
+    case ExecMode::Par:
+        return fn(std::execution::par);
+    case ExecMode::ParUnseq:
+        return fn(std::execution::par_unseq);
+    default:
+        return fn(std::execution::seq);
+    }
+}
+
+// unsequenced element functions must not allocate or lock, so stages that build strings run par_unseq as par
+auto allocatingStage = [](ExecMode mode)
+{
+    return mode == ExecMode::ParUnseq ? ExecMode::Par : mode;
+};
+
+enum class TaskPriority
+{
+    Low,
+    Normal,
+    High
+};
+
+struct EngineConfig
+{
+    size_t threads = 0;    // 0 = one per hardware thread
+    std::vector<int> cpus; // pin worker slots to these CPUs round-robin, empty = no pinning
+};
+
+// the process-wide worker pool: TBB's work-stealing scheduler (one task deque per worker) behind one arena per
+// priority, all of the configured size. Worker threads are started once and reused by every run and every book;
+// everything started inside run(), including the std::execution stages, stays on these workers.
+class Engine
+{
+public:
+    explicit Engine(EngineConfig config)
+        : size(config.threads != 0 ? config.threads : static_cast<size_t>(tbb::info::default_concurrency())),
+          limit(tbb::global_control::max_allowed_parallelism, size)
+    {
+        const tbb::task_arena::priority priorities[] = {tbb::task_arena::priority::low, tbb::task_arena::priority::normal, tbb::task_arena::priority::high};
+        for (size_t p = 0; p < arenas.size(); ++p)
+        {
+            arenas[p] = std::make_unique<tbb::task_arena>(static_cast<int>(size), 1, priorities[p]);
+            arenas[p]->initialize();
+            if (!config.cpus.empty())
+            {
+                pinning.push_back(std::make_unique<Pinning>(*arenas[p], config.cpus));
+            }
+        }
+    }
+
+    size_t threads() const { return size; }
+
+    // runs fn on the pool and waits for it, including all parallel work fn starts
+    template <typename F>
+    auto run(F &&fn, TaskPriority priority = TaskPriority::Normal)
+    {
+        return arena(priority).execute(std::forward<F>(fn));
+    }
+
+    // starts fn without waiting; wait() blocks until everything submitted so far has finished
+    template <typename F>
+    void submit(F fn, TaskPriority priority = TaskPriority::Normal)
+    {
+        const auto p = static_cast<size_t>(priority);
+        arenas[p]->execute([&]
+                           { groups[p].run(std::move(fn)); });
+    }
+
+    void wait()
+    {
+        for (size_t p = arenas.size(); p-- > 0;)
+        {
+            arenas[p]->execute([&]
+                               { groups[p].wait(); });
+        }
+    }
+
+private:
+    // pins every worker that joins the arena to the CPU of its slot and gives it its old affinity back when it leaves,
+    // since workers move between the arenas; the calling thread is left alone
+    class Pinning : public tbb::task_scheduler_observer
+    {
+    public:
+        Pinning(tbb::task_arena &arena, std::vector<int> cpus) : tbb::task_scheduler_observer(arena), cpus(std::move(cpus)) { observe(true); }
+
+        ~Pinning() override { observe(false); }
+
+        void on_scheduler_entry(bool isWorker) override
+        {
+#if defined(__linux__)
+            if (!isWorker)
+            {
+                return;
+            }
+            auto &[saved, valid] = previous.local();
+            valid = sched_getaffinity(0, sizeof(saved), &saved) == 0;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[static_cast<size_t>(tbb::this_task_arena::current_thread_index()) % cpus.size()], &set);
+            sched_setaffinity(0, sizeof(set), &set); // best effort: an unavailable CPU leaves the thread unpinned
+#endif
+        }
+
+        void on_scheduler_exit(bool isWorker) override
+        {
+#if defined(__linux__)
+            if (!isWorker)
+            {
+                return;
+            }
+            const auto &[saved, valid] = previous.local();
+            if (valid)
+            {
+                sched_setaffinity(0, sizeof(saved), &saved);
+            }
+#endif
+        }
+
+    private:
+        std::vector<int> cpus;
+#if defined(__linux__)
+        tbb::enumerable_thread_specific<std::pair<cpu_set_t, bool>> previous; // affinity before entry, if it could be read
+#endif
+    };
+
+    tbb::task_arena &arena(TaskPriority priority) { return *arenas[static_cast<size_t>(priority)]; }
+
+    size_t size;
+    tbb::global_control limit; // lets the pool be larger than the hardware
+    std::array<std::unique_ptr<tbb::task_arena>, 3> arenas;
+    std::array<tbb::task_group, 3> groups;
+    std::vector<std::unique_ptr<Pinning>> pinning;
+};
+
+// allocation counts of the process since tracking was enabled, or of one stage scope
+struct AllocationCounts
+{
+    uint64_t allocations = 0;
+    uint64_t bytes = 0; // as handed out by malloc, size rounding included
+    int64_t live = 0;   // allocated minus freed bytes
+    int64_t peak = 0;   // highest live bytes
+};
+
+// process-wide allocation counters, fed by the replaced global operator new and delete below. The replacement is
+// only compiled in with -DFPROG_TRACK_ALLOCATIONS, so other builds keep the plain allocator; in a tracking build the
+// counters are off until enable(). Counting is process-wide, so a stage includes the allocations of the workers
+// running its parallel loops, and scopes that overlap in time (the per-chunk lambdas) see each other's.
+// Every block starts with a prefix whose last 8 bytes hold the bytes counted for it, 0 if tracking was off, so only
+// blocks allocated while enabled are subtracted again and the process-wide live bytes never go below zero.
+class AllocationTracker
+{
+public:
+#if defined(FPROG_TRACK_ALLOCATIONS)
+    static constexpr bool available = true;
+#else
+    static constexpr bool available = false; // the counters stay 0
+#endif
+
+    static void enable(bool on = true) { active.store(on, std::memory_order_relaxed); }
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+    // bytes in front of the caller's block for an allocation of this alignment; a multiple of it, so alignment holds
+    static constexpr size_t prefix(size_t alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+    {
+        return std::max<size_t>(alignment, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+    }
+
+    // block is what malloc returned, the caller gets the address behind the prefix
+    static void *allocated(void *block, size_t prefixBytes)
+    {
+        uint64_t counted = 0;
+        if (enabled())
+        {
+            const auto usable = blockSize(block);
+            counted = usable > prefixBytes ? usable - prefixBytes : 0;
+            allocations.fetch_add(1, std::memory_order_relaxed);
+            bytes.fetch_add(counted, std::memory_order_relaxed);
+            const auto size = static_cast<int64_t>(counted);
+            raisePeak(live.fetch_add(size, std::memory_order_relaxed) + size);
+        }
+        auto *user = static_cast<char *>(block) + prefixBytes;
+        std::memcpy(user - sizeof(counted), &counted, sizeof(counted));
+        return user;
+    }
+
+    // returns the block to hand to free()
+    static void *freed(void *user, size_t prefixBytes)
+    {
+        if (user == nullptr)
+        {
+            return nullptr;
+        }
+        uint64_t counted;
+        std::memcpy(&counted, static_cast<char *>(user) - sizeof(counted), sizeof(counted));
+        if (counted != 0)
+        {
+            live.fetch_sub(static_cast<int64_t>(counted), std::memory_order_relaxed);
+        }
+        return static_cast<char *>(user) - prefixBytes;
+    }
+
+    static AllocationCounts counts()
+    {
+        return {allocations.load(std::memory_order_relaxed), bytes.load(std::memory_order_relaxed), live.load(std::memory_order_relaxed),
+                peak.load(std::memory_order_relaxed)};
+    }
+
+    // a scope measures its own high-water mark: startPeak() lowers the mark to the current live bytes and returns the
+    // old one, endPeak(old) puts back the higher of both for the enclosing scopes
+    static int64_t startPeak() { return peak.exchange(live.load(std::memory_order_relaxed), std::memory_order_relaxed); }
+    static void endPeak(int64_t previous) { raisePeak(previous); }
+
+private:
+    static void raisePeak(int64_t value)
+    {
+        auto high = peak.load(std::memory_order_relaxed);
+        while (value > high && !peak.compare_exchange_weak(high, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    static size_t blockSize(void *block)
+    {
+#if defined(__linux__)
+        return malloc_usable_size(block);
+#elif defined(__APPLE__)
+        return malloc_size(block);
+#else
+        (void)block;
+        return 0; // allocation counts only
+#endif
+    }
+
+    inline static std::atomic<bool> active{false};
+    inline static std::atomic<uint64_t> allocations{0};
+    inline static std::atomic<uint64_t> bytes{0};
+    inline static std::atomic<int64_t> live{0};
+    inline static std::atomic<int64_t> peak{0};
+};
+
+#if defined(FPROG_TRACK_ALLOCATIONS)
+// the replaceable global allocation functions. The deletes stay out of line: inlined into a caller, GCC would take
+// the free() for a mismatch with the operator new the pointer came from.
+void *operator new(std::size_t size)
+{
+    constexpr auto prefix = AllocationTracker::prefix();
+    if (size > std::numeric_limits<size_t>::max() - prefix)
+    {
+        throw std::bad_alloc();
+    }
+    void *block;
+    while ((block = std::malloc(prefix + std::max<size_t>(size, 1))) == nullptr)
+    {
+        const auto handler = std::get_new_handler();
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+    return AllocationTracker::allocated(block, prefix);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    const auto prefix = AllocationTracker::prefix(static_cast<size_t>(alignment));
+    if (size > std::numeric_limits<size_t>::max() - 2 * prefix)
+    {
+        throw std::bad_alloc();
+    }
+    const auto rounded = prefix + (std::max<size_t>(size, 1) + prefix - 1) / prefix * prefix; // aligned_alloc takes multiples of the alignment
+    void *block;
+    while ((block = std::aligned_alloc(prefix, rounded)) == nullptr)
+    {
+        const auto handler = std::get_new_handler();
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+    return AllocationTracker::allocated(block, prefix);
+}
+
+[[gnu::noinline]] void operator delete(void *block) noexcept
+{
+    std::free(AllocationTracker::freed(block, AllocationTracker::prefix()));
+}
+
+[[gnu::noinline]] void operator delete(void *block, std::align_val_t alignment) noexcept
+{
+    std::free(AllocationTracker::freed(block, AllocationTracker::prefix(static_cast<size_t>(alignment))));
+}
+
+void operator delete(void *block, std::size_t) noexcept
+{
+    operator delete(block);
+}
+
+void operator delete(void *block, std::size_t, std::align_val_t alignment) noexcept
+{
+    operator delete(block, alignment);
+}
+
+// every other form forwards to the four above, so no runtime (a sanitizer, say) supplies half of a pair
+void *operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return operator new(size);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return operator new(size, alignment);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return operator new(size, alignment, std::nothrow);
+}
+
+void operator delete[](void *block) noexcept
+{
+    operator delete(block);
+}
+
+void operator delete[](void *block, std::size_t) noexcept
+{
+    operator delete(block);
+}
+
+void operator delete[](void *block, std::align_val_t alignment) noexcept
+{
+    operator delete(block, alignment);
+}
+
+void operator delete[](void *block, std::size_t, std::align_val_t alignment) noexcept
+{
+    operator delete(block, alignment);
+}
+
+void operator delete(void *block, const std::nothrow_t &) noexcept
+{
+    operator delete(block);
+}
+
+void operator delete[](void *block, const std::nothrow_t &) noexcept
+{
+    operator delete(block);
+}
+
+void operator delete(void *block, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    operator delete(block, alignment);
+}
+
+void operator delete[](void *block, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    operator delete(block, alignment);
+}
+#endif
+
+struct StageTotals
+{
+    uint64_t calls = 0;
+    double wallMilliseconds = 0;
+    double cpuMilliseconds = 0; // of the thread that ran the scope; parallel work is charged to the scopes the workers enter
+    uint64_t allocations = 0;   // the allocation fields stay 0 unless the AllocationTracker is enabled
+    uint64_t allocatedBytes = 0;
+    int64_t liveBytes = 0; // allocated minus freed over all calls: what the stage leaves behind
+    int64_t peakBytes = 0; // highest live bytes above the level at entry, in any call
+};
+
+// CPU time consumed so far by the calling thread
+auto threadCpuMilliseconds = []
+{
+#if defined(__linux__)
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+#else
+    return 1000.0 * std::clock() / CLOCKS_PER_SEC;
+#endif
+};
+
+// process-wide stage timings, off until enable(). Every thread sums into its own table, so recording takes no lock;
+// stages are keyed by their name literal.
+class Profiler
+{
+public:
+    static Profiler &global()
+    {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    void enable(bool on = true) { active.store(on, std::memory_order_relaxed); }
+    bool enabled() const { return active.load(std::memory_order_relaxed); }
+
+    void record(std::string_view stage, double wallMilliseconds, double cpuMilliseconds, const AllocationCounts &allocated = {})
+    {
+        auto &totals = perThread.local()[stage];
+        ++totals.calls;
+        totals.wallMilliseconds += wallMilliseconds;
+        totals.cpuMilliseconds += cpuMilliseconds;
+        totals.allocations += allocated.allocations;
+        totals.allocatedBytes += allocated.bytes;
+        totals.liveBytes += allocated.live;
+        totals.peakBytes = std::max(totals.peakBytes, allocated.peak);
+    }
+
+    // merged over all threads; nested scopes are inclusive
+    std::map<std::string, StageTotals> totals() const
+    {
+        std::map<std::string, StageTotals> merged;
+        for (const auto &table : perThread)
+        {
+            for (const auto &[stage, totals] : table)
+            {
+                auto &sum = merged[std::string(stage)];
+                sum.calls += totals.calls;
+                sum.wallMilliseconds += totals.wallMilliseconds;
+                sum.cpuMilliseconds += totals.cpuMilliseconds;
+                sum.allocations += totals.allocations;
+                sum.allocatedBytes += totals.allocatedBytes;
+                sum.liveBytes += totals.liveBytes;
+                sum.peakBytes = std::max(sum.peakBytes, totals.peakBytes);
+            }
+        }
+        return merged;
+    }
+
+    void reset() { perThread.clear(); }
+
+private:
+    Profiler() = default;
+
+    std::atomic<bool> active{false};
+    tbb::enumerable_thread_specific<std::unordered_map<std::string_view, StageTotals>> perThread;
+};
+
+// adds the wall and CPU time of its lifetime, and what it allocated while the AllocationTracker is on, to a stage;
+// a disabled profiler costs one relaxed load
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(std::string_view stage) : stage(stage), active(Profiler::global().enabled()), tracking(active && AllocationTracker::enabled())
+    {
+        if (tracking)
+        {
+            outerPeak = AllocationTracker::startPeak();
+            allocationStart = AllocationTracker::counts();
+        }
+        if (active)
+        {
+            wallStart = std::chrono::steady_clock::now();
+            cpuStart = threadCpuMilliseconds();
+        }
+    }
+
+    ~ScopedTimer()
+    {
+        if (active)
+        {
+            const auto wallMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+            const auto cpuMilliseconds = threadCpuMilliseconds() - cpuStart;
+            AllocationCounts allocated;
+            if (tracking)
+            {
+                const auto now = AllocationTracker::counts();
+                allocated = {now.allocations - allocationStart.allocations, now.bytes - allocationStart.bytes, now.live - allocationStart.live,
+                             now.peak - allocationStart.live};
+                AllocationTracker::endPeak(outerPeak);
+            }
+            Profiler::global().record(stage, wallMilliseconds, cpuMilliseconds, allocated);
+        }
+    }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+    std::string_view stage;
+    bool active;
+    bool tracking;
+    std::chrono::steady_clock::time_point wallStart;
+    double cpuStart = 0;
+    AllocationCounts allocationStart;
+    int64_t outerPeak = 0;
+};
+
+// JSON report: process totals, then every stage by descending wall time; allocation fields only with process allocation counts
+auto writeProfile = [](const std::map<std::string, StageTotals> &stages, double wallMilliseconds, double cpuMilliseconds, const std::string &filename,
+                       const std::optional<AllocationCounts> &allocations = std::nullopt) -> Result<Success>
+{
+    std::ofstream file(filename);
+    if (!file)
+    {
+        return "Error opening profile file: " + filename;
+    }
+
+    std::vector<std::pair<std::string, StageTotals>> ordered(stages.begin(), stages.end());
+    std::stable_sort(ordered.begin(), ordered.end(), [](const auto &a, const auto &b)
+                     { return a.second.wallMilliseconds > b.second.wallMilliseconds; });
+
+    file << std::fixed << std::setprecision(3) << "{\n  \"wallMilliseconds\": " << wallMilliseconds << ",\n  \"cpuMilliseconds\": " << cpuMilliseconds;
+    if (allocations)
+    {
+        file << ",\n  \"allocations\": " << allocations->allocations << ",\n  \"allocatedBytes\": " << allocations->bytes << ",\n  \"peakBytes\": "
+             << allocations->peak;
+    }
+    file << ",\n  \"stages\": [";
+    for (const auto &[name, totals] : ordered)
+    {
+        file << (&name == &ordered.front().first ? "\n" : ",\n") << "    {\"name\": \"" << name << "\", \"calls\": " << totals.calls
+             << ", \"wallMilliseconds\": " << totals.wallMilliseconds << ", \"cpuMilliseconds\": " << totals.cpuMilliseconds;
+        if (allocations)
+        {
+            file << ", \"allocations\": " << totals.allocations << ", \"allocatedBytes\": " << totals.allocatedBytes << ", \"liveBytes\": " << totals.liveBytes
+                 << ", \"peakBytes\": " << totals.peakBytes;
+        }
+        file << "}";
+    }
+    file << "\n  ]\n}\n";
+
+    if (!file)
+    {
+        return "Error writing profile file: " + filename;
+    }
+    return Success{};
+};
+
 // create class for opening and closing file
 class FileHandler
 {
 public:
-    FileHandler() = default;
+    FileHandler() = default;
+
+    FileHandler(const string &filename) : file(filename)
+    {
+        if (!file.is_open())
+        {
+            throw runtime_error("Error opening file: " + filename);
+        }
+    }
+
+    ~FileHandler()
+    {
+        if (file.is_open())
+        {
+            file.close();
+        }
+    }
+
+    auto readLines()
+    {
+        vector<string> lines;
+        string line;
+        while (getline(file, line))
+        {
+            lines.push_back(line);
+        }
+        return lines;
+    }
+
+    auto writeLines(const std::vector<std::string> &lines, const std::string &filename, const std::string &unit)
+    {
+        std::ofstream file(filename);
+
+        if (!file)
+        {
+            throw std::runtime_error("Error opening output file: " + filename);
+        }
+
+        for (const auto &line : lines)
+        {
+            file << unit << " " << &line - &lines.front() + 1 << ": " << line << '\n';
+        }
+
+        std::cout << unit << " categorizations saved to '" << filename << "'" << std::endl;
+    }
+
+private:
+    ifstream file;
+};
+
+/*
+2) Read files: Create a function that reads a file and returns its content as a vector of strings.
+   The function should be implemented using functional programming, immutability, and lambdas where possible.
+*/
+auto readFile = [](const string &filename) -> Result<std::vector<std::string>>
+{
+    const ScopedTimer timer("readFile");
+    try
+    {
+        FileHandler fileHandler(filename);
+        return fileHandler.readLines(); // returns vector of lines
+    }
+    catch (const std::exception &e)
+    {
+        return "Error opening or reading file: " + filename + ". " + e.what();
+    }
+};
+
+// unit names each numbered line, e.g. "Chapter 12: war-related"
+auto writeLines = [](const std::vector<std::string> &lines, const std::string &filename, const std::string &unit = "Chapter") -> Result<Success>
+{
+    const ScopedTimer timer("writeLines");
+    try
+    {
+        FileHandler fileHandler;
+        fileHandler.writeLines(lines, filename, unit);
+        return Success{};
+    }
+    catch (const std::exception &e)
+    {
+        return "Error writing to file: " + filename + ". " + e.what();
+    }
+};
+
+/*
+3) Tokenize the text: Create a function to tokenize a string into words.
+   This function should use functional programming techniques and lambdas for string manipulation and splitting.
+*/
+auto isDelimiter = [](char c)
+{
+    return c == ' ' || c == '\r' || c == '\n' || c == '\t' ||
+           c == ',' || c == ':' || c == ';' || c == '.' || c == '!' || c == '?' ||
+           c == '\'' || c == '\"'; // not sure what delimiters we should use
+};
+
+auto tokenize = [](const std::string &text)
+{
+    return text | ranges::views::split_when(isDelimiter) |
+           ranges::views::transform([](auto &&rng)
+                                    { return std::string(&*rng.begin(), ranges::distance(rng)); });
+}; // returns view of strings
+
+auto tokenizeAll = [](const std::vector<std::string> &lines, ExecMode exec = ExecMode::Seq)
+{
+    const ScopedTimer timer("tokenizeAll");
+    if (exec == ExecMode::Seq)
+    {
+        std::vector<std::string> result;
+        result.reserve(lines.size());
+
+        for (const auto &line : lines)
+        {
+            auto words = tokenize(line) | to<std::vector<std::string>>;
+            // insert elements directly at end without reallocation
+            result.insert(result.end(), words.begin(), words.end());
+        }
+
+        return result;
+    }
+
+    // lines are tokenized independently, an exclusive scan over their token counts gives each line its output offset
+    std::vector<std::vector<std::string>> lineWords(lines.size());
+    std::vector<size_t> offsets(lines.size());
+    withPolicy(allocatingStage(exec), [&](auto policy)
+               {
+                   std::transform(policy, lines.begin(), lines.end(), lineWords.begin(), [](const std::string &line)
+                                  { return tokenize(line) | to<std::vector<std::string>>; });
+                   std::transform_exclusive_scan(policy, lineWords.begin(), lineWords.end(), offsets.begin(), size_t{0}, std::plus<>(),
+                                                 [](const std::vector<std::string> &words)
+                                                 { return words.size(); }); });
+
+    std::vector<std::string> result(lines.empty() ? 0 : offsets.back() + lineWords.back().size());
+    withPolicy(exec, [&](auto policy)
+               { std::for_each(policy, lineWords.begin(), lineWords.end(), [&](std::vector<std::string> &words)
+                               { std::move(words.begin(), words.end(), result.begin() + offsets[&words - lineWords.data()]); }); });
+
+    return result;
+}; // returns vector of strings
+
+// same tokens as tokenizeAll over the lines of a raw buffer, as string_views into the buffer.
+// Like split_when, a non-empty line that starts with a delimiter yields one empty token first.
+// atLineStart = false when text begins in the middle of a line.
+template <typename F>
+void forEachToken(std::string_view text, F onToken, bool atLineStart = true)
+{
+    size_t lineBegin = 0;
+    while (lineBegin < text.size())
+    {
+        const auto lineEnd = std::min(text.find('\n', lineBegin), text.size());
+        if (lineEnd > lineBegin && isDelimiter(text[lineBegin]) && (lineBegin != 0 || atLineStart))
+        {
+            onToken(std::string_view());
+        }
+        for (auto i = lineBegin; i < lineEnd;)
+        {
+            while (i < lineEnd && isDelimiter(text[i]))
+            {
+                ++i;
+            }
+            const auto tokenBegin = i;
+            while (i < lineEnd && !isDelimiter(text[i]))
+            {
+                ++i;
+            }
+            if (i > tokenBegin)
+            {
+                onToken(text.substr(tokenBegin, i - tokenBegin));
+            }
+        }
+        lineBegin = lineEnd + 1;
+    }
+}
+
+/*
+4) Filter words: Create a function to filter words from a list based on another list.
+   This function should use functional programming techniques, such as higher-order functions and lambdas, to perform filtering.
+*/
+// read-only view of consecutive tokens, e.g. one chapter of the book; a whole vector converts implicitly
+using WordSpan = ranges::span<const std::string>;
+
+// [begin, end) token positions
+using TokenRange = std::pair<size_t, size_t>;
+
+auto wordSpan = [](const std::vector<std::string> &tokens, TokenRange range)
+{
+    return WordSpan(tokens.data() + range.first, static_cast<std::ptrdiff_t>(range.second - range.first));
+};
+
+// the same view over interned token ids, which is what the chapter scorers run on
+using IdSpan = ranges::span<const uint32_t>;
+
+auto idSpan = [](const std::vector<uint32_t> &ids, TokenRange range)
+{
+    return IdSpan(ids.data() + range.first, static_cast<std::ptrdiff_t>(range.second - range.first));
+};
+
+auto filterWords = [](WordSpan words, const std::vector<std::string> &filterList)
+{
+    const ScopedTimer timer("filterWords");
+    std::vector<std::string> result;
+    std::copy_if(words.begin(), words.end(), std::back_inserter(result), [&filterList](const std::string &word)
+                 { return std::find(filterList.begin(), filterList.end(), word) != filterList.end(); });
+    return result; // returns vector containing filtered words
+};
+
+// bump allocator for map keys: blocks never move, so stored keys can be referenced by string_view
+class StringArena
+{
+public:
+    std::string_view store(std::string_view text)
+    {
+        if (text.empty())
+        {
+            return {};
+        }
+        if (text.size() > remaining)
+        {
+            const auto blockSize = std::max(BLOCK_SIZE, text.size());
+            blocks.push_back(std::make_unique<char[]>(blockSize));
+            next = blocks.back().get();
+            remaining = blockSize;
+        }
+        std::memcpy(next, text.data(), text.size());
+        const std::string_view stored(next, text.size());
+        next += text.size();
+        remaining -= text.size();
+        return stored;
+    }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *next = nullptr;
+    size_t remaining = 0;
+};
+
+/*
+Flat open-addressing hash map for short string keys (swiss-table layout): one control byte per slot
+holding 7 bits of the hash, probed 16 slots at a time with SSE2. Slots store the full hash inline
+and keys live in an arena, so there is no allocation per key and no pointer chase per probe.
+Entries are never erased, which is all counting and term lookup need.
+*/
+template <typename V>
+class FlatStringMap
+{
+public:
+    struct Entry
+    {
+        std::string_view key;
+        uint64_t hash;
+        V value;
+    };
+
+    // inserts value if key is not present yet; returns the entry and whether it was inserted
+    std::pair<Entry &, bool> tryEmplace(std::string_view key, V value)
+    {
+        const auto hash = hashKey(key);
+        const auto index = findIndex(key, hash);
+        if (index != NOT_FOUND)
+        {
+            return {slots[index], false};
+        }
+        if ((count + 1) * 8 > slots.size() * 7)
+        {
+            grow();
+        }
+        return {insert(arena.store(key), hash, std::move(value)), true};
+    }
+
+    V &operator[](std::string_view key) { return tryEmplace(key, V{}).first.value; }
+
+    const V *find(std::string_view key) const
+    {
+        const auto index = findIndex(key, hashKey(key));
+        return index == NOT_FOUND ? nullptr : &slots[index].value;
+    }
+
+    size_t size() const { return count; }
+
+    template <typename F>
+    void forEach(F f) const
+    {
+        for (size_t i = 0; i < slots.size(); ++i)
+        {
+            if (control[i] != EMPTY)
+            {
+                f(slots[i].key, slots[i].value);
+            }
+        }
+    }
+
+private:
+    static constexpr int8_t EMPTY = -128;
+    static constexpr size_t GROUP_WIDTH = 16;
+    static constexpr size_t NOT_FOUND = static_cast<size_t>(-1);
+
+    std::vector<int8_t> control; // EMPTY or low 7 hash bits
+    std::vector<Entry> slots;
+    StringArena arena;
+    size_t count = 0;
+
+    static uint64_t hashKey(std::string_view key) { return std::hash<std::string_view>{}(key); }
+    static int8_t tag(uint64_t hash) { return static_cast<int8_t>(hash & 0x7F); }
+
+    // bit i is set if control byte i of the group equals value
+    static uint32_t matchGroup(const int8_t *group, int8_t value)
+    {
+#if defined(__SSE2__)
+        const auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(value))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_WIDTH; ++i)
+        {
+            mask |= static_cast<uint32_t>(group[i] == value) << i;
+        }
+        return mask;
+#endif
+    }
+
+    // triangular probing over groups visits every group because the group count is a power of two
+    size_t findIndex(std::string_view key, uint64_t hash) const
+    {
+        if (slots.empty())
+        {
+            return NOT_FOUND;
+        }
+        const auto groupMask = slots.size() / GROUP_WIDTH - 1;
+        auto group = (hash >> 7) & groupMask;
+        for (size_t step = 1;; ++step)
+        {
+            const auto *groupControl = &control[group * GROUP_WIDTH];
+            for (auto matches = matchGroup(groupControl, tag(hash)); matches != 0; matches &= matches - 1)
+            {
+                const auto index = group * GROUP_WIDTH + __builtin_ctz(matches);
+                if (slots[index].hash == hash && slots[index].key == key)
+                {
+                    return index;
+                }
+            }
+            if (matchGroup(groupControl, EMPTY) != 0)
+            {
+                return NOT_FOUND;
+            }
+            group = (group + step) & groupMask;
+        }
+    }
+
+    Entry &insert(std::string_view key, uint64_t hash, V value)
+    {
+        const auto groupMask = slots.size() / GROUP_WIDTH - 1;
+        auto group = (hash >> 7) & groupMask;
+        for (size_t step = 1;; ++step)
+        {
+            const auto empty = matchGroup(&control[group * GROUP_WIDTH], EMPTY);
+            if (empty != 0)
+            {
+                const auto index = group * GROUP_WIDTH + __builtin_ctz(empty);
+                control[index] = tag(hash);
+                slots[index] = Entry{key, hash, std::move(value)};
+                ++count;
+                return slots[index];
+            }
+            group = (group + step) & groupMask;
+        }
+    }
+
+    // rehash from the inline hashes, keys stay where they are in the arena
+    void grow()
+    {
+        const auto capacity = std::max(GROUP_WIDTH, slots.size() * 2);
+        auto oldControl = std::exchange(control, std::vector<int8_t>(capacity, EMPTY));
+        auto oldSlots = std::exchange(slots, std::vector<Entry>(capacity));
+        count = 0;
+        for (size_t i = 0; i < oldSlots.size(); ++i)
+        {
+            if (oldControl[i] != EMPTY)
+            {
+                insert(oldSlots[i].key, oldSlots[i].hash, std::move(oldSlots[i].value));
+            }
+        }
+    }
+};
+
+/*
+5) Count occurrences: Create a function to count the occurrences of words in a list.
+   This function should use the map-reduce philosophy and functional programming techniques
+   to count word occurrences in a parallelizable and efficient manner.
+*/
+// every distinct token gets a dense id in first-seen order
+class Vocabulary
+{
+public:
+    uint32_t intern(std::string_view word)
+    {
+        const auto [entry, inserted] = ids.tryEmplace(word, static_cast<uint32_t>(words.size()));
+        if (inserted)
+        {
+            words.push_back(entry.key);
+        }
+        return entry.value;
+    }
+
+    std::string_view word(uint32_t id) const { return words[id]; }
+
+    const std::vector<std::string_view> &allWords() const { return words; }
+
+    size_t size() const { return words.size(); }
+
+private:
+    FlatStringMap<uint32_t> ids;
+    std::vector<std::string_view> words; // id -> word, stored in the arena of ids
+};
+
+struct InternedTokens
+{
+    Vocabulary vocabulary;
+    std::vector<uint32_t> ids; // one id per token, in book order
+};
+
+// map: every partition interns its words into its own table, the string hashing runs in parallel.
+// reduce: the partition tables are merged in book order, so every word gets the id of a sequential first-seen scan;
+// only the distinct words of each partition go through the shared table, and the ids are then remapped in parallel
+auto internWords = [](WordSpan words, size_t grainSize = 65536)
+{
+    const auto size = static_cast<size_t>(words.size());
+    const auto partitions = size == 0 ? size_t{0} : (size - 1) / grainSize + 1;
+    std::vector<InternedTokens> local(partitions);
+    tbb::parallel_for(size_t{0}, partitions, [&](size_t p)
+                      {
+                          const auto end = std::min(size, (p + 1) * grainSize);
+                          local[p].ids.reserve(end - p * grainSize);
+                          for (auto i = p * grainSize; i != end; ++i)
+                          {
+                              local[p].ids.push_back(local[p].vocabulary.intern(words[i]));
+                          } });
+
+    InternedTokens result;
+    std::vector<std::vector<uint32_t>> globalIds(partitions); // local id -> id in result, per partition
+    for (size_t p = 0; p < partitions; ++p)
+    {
+        for (const auto word : local[p].vocabulary.allWords())
+        {
+            globalIds[p].push_back(result.vocabulary.intern(word));
+        }
+    }
+    result.ids.resize(size);
+    tbb::parallel_for(size_t{0}, partitions, [&](size_t p)
+                      { std::transform(local[p].ids.begin(), local[p].ids.end(), result.ids.begin() + p * grainSize, [&globalIds, p](uint32_t id)
+                                       { return globalIds[p][id]; }); });
+    return result;
+};
+
+auto internTokens = [](const std::vector<std::string> &tokens)
+{
+    const ScopedTimer timer("internTokens");
+    return internWords(tokens);
+};
+
+// sparse-to-dense scatter: dense counters sized to the vocabulary, plus the list of ids touched since
+// the last reset, so clearing between chapters costs O(chapter tokens) instead of O(vocabulary)
+class ChapterHistogram
+{
+public:
+    explicit ChapterHistogram(size_t vocabularySize) : counts(vocabularySize, 0) {}
+
+    void add(uint32_t id)
+    {
+        if (counts[id]++ == 0)
+        {
+            touched.push_back(id);
+        }
+    }
+
+    uint32_t count(uint32_t id) const { return counts[id]; }
+
+    // returns (id, count) pairs in first-seen order
+    std::vector<std::pair<uint32_t, uint32_t>> entries() const
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> result;
+        result.reserve(touched.size());
+        std::transform(touched.begin(), touched.end(), std::back_inserter(result), [this](uint32_t id)
+                       { return std::make_pair(id, counts[id]); });
+        return result;
+    }
+
+    void reset()
+    {
+        for (const auto id : touched)
+        {
+            counts[id] = 0;
+        }
+        touched.clear();
+    }
+
+private:
+    std::vector<uint32_t> counts;
+    std::vector<uint32_t> touched;
+};
+
+// sparse counts of a part of the ids: (id, count) sorted by id
+using IdCounts = std::vector<std::pair<uint32_t, uint32_t>>;
+
+auto mergeIdCounts = [](const IdCounts &left, const IdCounts &right)
+{
+    IdCounts merged;
+    merged.reserve(left.size() + right.size());
+    auto l = left.begin();
+    auto r = right.begin();
+    while (l != left.end() || r != right.end())
+    {
+        if (r == right.end() || (l != left.end() && l->first < r->first))
+        {
+            merged.push_back(*l++);
+        }
+        else if (l == left.end() || r->first < l->first)
+        {
+            merged.push_back(*r++);
+        }
+        else
+        {
+            merged.emplace_back(l->first, l->second + r->second);
+            ++l;
+            ++r;
+        }
+    }
+    return merged;
+};
+
+/*
+Dense counting on interned ids: ids are 0..vocabularySize-1, so a plain array replaces the hash table.
+map: every partition scatters its ids into the scratch histogram of its thread and keeps only the (id, count) pairs it
+touched, so a partial costs the partition's distinct words and not the vocabulary; reduce: partials are merged along
+the task tree and spread into the dense result once at the end.
+*/
+auto countIdOccurrences = [](const std::vector<uint32_t> &ids, size_t vocabularySize, size_t grainSize = 16384)
+{
+    const ScopedTimer timer("countIdOccurrences");
+    tbb::enumerable_thread_specific<ChapterHistogram> scratch([vocabularySize]
+                                                              { return ChapterHistogram(vocabularySize); });
+    const auto sparse = tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, ids.size(), grainSize), IdCounts(),
+        [&ids, &scratch](const tbb::blocked_range<size_t> &range, const IdCounts &partial)
+        {
+            auto &histogram = scratch.local();
+            for (auto i = range.begin(); i != range.end(); ++i)
+            {
+                histogram.add(ids[i]);
+            }
+            auto counts = histogram.entries();
+            histogram.reset();
+            std::sort(counts.begin(), counts.end());
+            return partial.empty() ? counts : mergeIdCounts(partial, counts);
+        },
+        mergeIdCounts);
+
+    std::vector<uint32_t> count(vocabularySize, 0);
+    for (const auto &[id, occurrences] : sparse)
+    {
+        count[id] = occurrences;
+    }
+    return count; // returns vector: index=word id, value=counts of the word
+};
+
+auto countOccurrences = [](WordSpan words, size_t grainSize = 65536)
+{
+    const ScopedTimer timer("countOccurrences");
+    const auto interned = internWords(words, grainSize);
+    const auto idCounts = countIdOccurrences(interned.ids, interned.vocabulary.size(), grainSize);
+
+    std::unordered_map<std::string, int> count;
+    count.reserve(idCounts.size());
+    for (uint32_t id = 0; id < idCounts.size(); ++id)
+    {
+        count.emplace(interned.vocabulary.word(id), static_cast<int>(idCounts[id]));
+    }
+    return count; // returns map: key=word, value=counts of the word
+};
+
+/*
+6) Calculate term density: Create a function to calculate the density of terms in a text,
+   based on the occurrences of words and their relative distances to the next word of the same category.
+   This function should use functional programming techniques and the map-reduce philosophy for parallelization and efficiency.
+*/
+auto calculateDensity = [](WordSpan words, const std::unordered_map<std::string, int> &occurrences) // bisher 66,85% Übereinstimmung mit Moodle Lösung lol
+{
+    const ScopedTimer timer("calculateDensity");
+    if (words.empty())
+    {
+        return 0.0;
+    }
+
+    int total_occurrences = 0;
+
+    for (const auto &term : occurrences)
+    {
+        total_occurrences += term.second;
+    }
+
+    return static_cast<double>(total_occurrences) / words.size();
+};
+
+/*
+Distance-aware density: every hit counts once, and each pair of consecutive hits of the same category
+adds 1 / gap, so clustered terms weigh more than the same number of scattered ones.
+HitSpacing is the streaming state of one category over a token span. Spans combine associatively
+(a segmented scan), so a long text can be split into chunks, scanned in parallel and reduced.
+*/
+struct HitSpacing
+{
+    size_t length = 0;
+    size_t hits = 0;
+    size_t firstHit = 0; // positions relative to the start of the span
+    size_t lastHit = 0;
+    // sum of 1 / gap over consecutive hits in fixed point: each term is rounded once, and integer sums do not
+    // depend on the order of additions, so any split of the text and any reduction tree give the same bits
+    uint64_t proximity = 0;
+
+    static constexpr uint64_t PROXIMITY_ONE = uint64_t{1} << 40;
+
+    static uint64_t reciprocal(size_t gap) { return (PROXIMITY_ONE + gap / 2) / gap; }
+
+    double proximityValue() const { return static_cast<double>(proximity) / PROXIMITY_ONE; }
+
+    void add(bool hit)
+    {
+        if (hit)
+        {
+            if (hits != 0)
+            {
+                proximity += reciprocal(length - lastHit);
+            }
+            else
+            {
+                firstHit = length;
+            }
+            lastHit = length;
+            ++hits;
+        }
+        ++length;
+    }
+
+    double density() const { return length == 0 ? 0.0 : (hits + proximityValue()) / length; }
+
+    static HitSpacing combine(const HitSpacing &left, const HitSpacing &right)
+    {
+        HitSpacing result;
+        result.length = left.length + right.length;
+        result.hits = left.hits + right.hits;
+        result.proximity = left.proximity + right.proximity;
+        if (left.hits != 0 && right.hits != 0)
+        {
+            // the gap that crosses the chunk boundary
+            result.proximity += reciprocal(left.length - left.lastHit + right.firstHit);
+        }
+        result.firstHit = left.hits != 0 ? left.firstHit : (right.hits != 0 ? left.length + right.firstHit : 0);
+        result.lastHit = right.hits != 0 ? left.length + right.lastHit : left.lastHit;
+        return result;
+    }
+};
+
+auto calculateDistanceDensity = [](WordSpan words, const std::vector<std::string> &terms, size_t grainSize = 16384)
+{
+    const ScopedTimer timer("calculateDistanceDensity");
+    FlatStringMap<bool> termSet;
+    for (const auto &term : terms)
+    {
+        termSet[term] = true;
+    }
+
+    const auto spacing = tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, static_cast<size_t>(words.size()), grainSize), HitSpacing{},
+        [&](const tbb::blocked_range<size_t> &range, HitSpacing chunk)
+        {
+            // chunks arrive left to right for a given accumulator, so the scan just continues
+            HitSpacing local;
+            for (auto i = range.begin(); i != range.end(); ++i)
+            {
+                local.add(termSet.find(words[i]) != nullptr);
+            }
+            return HitSpacing::combine(chunk, local);
+        },
+        HitSpacing::combine);
+
+    return spacing.density();
+};
+
+/*
+Vocabulary: every distinct token gets a dense id, so normalization, stemming and term lookup
+are done once per vocabulary entry instead of once per occurrence in the book.
+*/
+enum Category : uint8_t
+{
+    NONE = 0,
+    WAR = 1 << 0,
+    PEACE = 1 << 1,
+    MARKER = 1 << 2 // "CHAPTER" heading token
+};
+
+enum class MatchMode
+{
+    Exact, // token must be equal to a term (original behaviour)
+    Stem   // lowercase and strip inflection suffixes on both sides before comparing
+};
+
+auto normalizeWord = [](const std::string &word)
+{
+    std::string result(word.size(), '\0');
+    std::transform(word.begin(), word.end(), result.begin(), [](unsigned char c)
+                   { return static_cast<char>(std::tolower(c)); });
+    return result;
+};
+
+// light suffix stripping so that e.g. "soldiers" and "soldier" share a stem
+auto stemWord = [](std::string word)
+{
+    auto endsWith = [&word](const std::string &suffix)
+    {
+        return word.size() >= suffix.size() && word.compare(word.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+
+    if (word.size() > 4 && endsWith("ies"))
+    {
+        word.replace(word.size() - 3, 3, "y");
+    }
+    else if (endsWith("sses") || endsWith("xes") || endsWith("ches") || endsWith("shes") || endsWith("zes"))
+    {
+        word.erase(word.size() - 2);
+    }
+    else if (word.size() > 3 && endsWith("s") && !endsWith("ss") && !endsWith("us") && !endsWith("is"))
+    {
+        word.erase(word.size() - 1);
+    }
+    else if (word.size() > 5 && endsWith("ing"))
+    {
+        word.erase(word.size() - 3);
+    }
+    else if (word.size() > 4 && endsWith("ed"))
+    {
+        word.erase(word.size() - 2);
+    }
+
+    return word;
+};
+
+auto matchKey = [](const std::string &word, MatchMode mode)
+{
+    return mode == MatchMode::Stem ? stemWord(normalizeWord(word)) : word;
+};
+
+// category of a single word: term lookup under the match mode, plus the chapter marker bit
+class TermClassifier
+{
+public:
+    TermClassifier(const std::vector<std::string> &warTokens, const std::vector<std::string> &peaceTokens, MatchMode mode) : mode(mode)
+    {
+        for (const auto &term : warTokens)
+        {
+            termCategories[matchKey(term, mode)] |= WAR;
+        }
+        for (const auto &term : peaceTokens)
+        {
+            termCategories[matchKey(term, mode)] |= PEACE;
+        }
+    }
+
+    uint8_t classify(std::string_view word) const
+    {
+        const auto *category = mode == MatchMode::Exact ? termCategories.find(word) : termCategories.find(matchKey(std::string(word), mode));
+        const uint8_t terms = category ? *category : uint8_t{NONE};
+        return word == "CHAPTER" ? static_cast<uint8_t>(terms | MARKER) : terms;
+    }
+
+private:
+    MatchMode mode;
+    FlatStringMap<uint8_t> termCategories;
+};
+
+// returns compact id -> category table, so categorizing a token is a single array index
+auto classifyVocabulary = [](const Vocabulary &vocabulary, const std::vector<std::string> &warTokens, const std::vector<std::string> &peaceTokens,
+                             MatchMode mode, ExecMode exec = ExecMode::Seq)
+{
+    const ScopedTimer timer("classifyVocabulary");
+    const TermClassifier classifier(warTokens, peaceTokens, mode);
+
+    // exact lookups only probe the term table, stemming builds a key string per word
+    std::vector<uint8_t> categories(vocabulary.size(), NONE);
+    withPolicy(mode == MatchMode::Stem ? allocatingStage(exec) : exec, [&](auto policy)
+               { std::transform(policy, vocabulary.allWords().begin(), vocabulary.allWords().end(), categories.begin(), [&classifier](std::string_view word)
+                                { return classifier.classify(word); }); });
+
+    return categories;
+};
+
+// a "CHAPTER" token opens a new chapter unless the current one holds exactly one word
+auto startsChapter = [](uint8_t category, size_t wordsInChapter)
+{
+    return (category & MARKER) && wordsInChapter != 1; // including && wordsInChapter != 0 would make sense but i get more percent without lol
+};
+
+enum class DensityMode
+{
+    Ratio,   // hits / words (original behaviour)
+    Distance // hits and closeness of consecutive hits, see HitSpacing
+};
+
+// running term counts of one chapter
+struct ChapterCounts
+{
+    size_t words = 0;
+    size_t warHits = 0;
+    size_t peaceHits = 0;
+    HitSpacing warSpacing;
+    HitSpacing peaceSpacing;
+
+    void add(uint8_t category)
+    {
+        ++words;
+        warHits += (category & WAR) != 0;
+        peaceHits += (category & PEACE) != 0;
+        warSpacing.add(category & WAR);
+        peaceSpacing.add(category & PEACE);
+    }
+
+    // counts of this chapter followed by the tokens counted in next
+    void merge(const ChapterCounts &next)
+    {
+        words += next.words;
+        warHits += next.warHits;
+        peaceHits += next.peaceHits;
+        warSpacing = HitSpacing::combine(warSpacing, next.warSpacing);
+        peaceSpacing = HitSpacing::combine(peaceSpacing, next.peaceSpacing);
+    }
+
+    double warDensity(DensityMode mode = DensityMode::Ratio) const
+    {
+        return mode == DensityMode::Distance ? warSpacing.density() : (words == 0 ? 0.0 : static_cast<double>(warHits) / words);
+    }
+    double peaceDensity(DensityMode mode = DensityMode::Ratio) const
+    {
+        return mode == DensityMode::Distance ? peaceSpacing.density() : (words == 0 ? 0.0 : static_cast<double>(peaceHits) / words);
+    }
+};
+
+// chapter splitting as a resumable scan: the closed chapters plus the one still open
+struct ChapterScan
+{
+    std::vector<ChapterCounts> closed;
+    ChapterCounts open;
+
+    void add(uint8_t category)
+    {
+        if (startsChapter(category, open.words))
+        {
+            closed.push_back(open);
+            open = ChapterCounts{};
+        }
+        open.add(category);
+    }
+
+    // closed chapters and the open one if it has words
+    std::vector<ChapterCounts> chapters() const
+    {
+        auto result = closed;
+        if (open.words != 0)
+        {
+            result.push_back(open);
+        }
+        return result;
+    }
+};
+
+auto chapterDensities = [](const std::vector<ChapterCounts> &chapters, DensityMode densityMode)
+{
+    const ScopedTimer timer("chapterDensities");
+    std::vector<double> warDensities(chapters.size());
+    std::vector<double> peaceDensities(chapters.size());
+    std::transform(chapters.begin(), chapters.end(), warDensities.begin(), [densityMode](const ChapterCounts &chapter)
+                   { return chapter.warDensity(densityMode); });
+    std::transform(chapters.begin(), chapters.end(), peaceDensities.begin(), [densityMode](const ChapterCounts &chapter)
+                   { return chapter.peaceDensity(densityMode); });
+    return std::make_pair(warDensities, peaceDensities);
+};
+
+// per-chapter sparse word histograms, chapters split the same way as in processChapters
+auto chapterHistograms = [](const std::vector<uint32_t> &ids, const std::vector<uint8_t> &categories)
+{
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> histograms;
+    ChapterHistogram histogram(categories.size());
+    size_t wordsInChapter = 0;
+
+    for (const auto id : ids)
+    {
+        if (startsChapter(categories[id], wordsInChapter))
+        {
+            histograms.push_back(histogram.entries());
+            histogram.reset();
+            wordsInChapter = 0;
+        }
+        histogram.add(id);
+        ++wordsInChapter;
+    }
+
+    if (wordsInChapter != 0)
+    {
+        histograms.push_back(histogram.entries());
+    }
+
+    return histograms;
+};
+
+// number of words that appear in terms; same total as countOccurrences(filterWords(...)) without building either
+auto countTermHits = [](WordSpan words, const std::vector<std::string> &terms)
+{
+    const ScopedTimer timer("countTermHits");
+    return static_cast<size_t>(std::count_if(words.begin(), words.end(), [&terms](const std::string &word)
+                                             { return std::find(terms.begin(), terms.end(), word) != terms.end(); }));
+};
+
+// scores one chapter in place: chapterWords is a view into the token storage and nothing is allocated
+// beyond the result slots (reserve the density vectors to avoid regrowth)
+auto processChapter = [](WordSpan chapterWords, const std::vector<std::string> &warTokens, const std::vector<std::string> &peaceTokens,
+                         std::vector<double> &warDensities, std::vector<double> &peaceDensities)
+{
+    const ScopedTimer timer("processChapter");
+    auto density = [&chapterWords](size_t hits)
+    { return chapterWords.empty() ? 0.0 : static_cast<double>(hits) / chapterWords.size(); };
+
+    warDensities.push_back(density(countTermHits(chapterWords, warTokens)));
+    peaceDensities.push_back(density(countTermHits(chapterWords, peaceTokens)));
+};
+
+/*
+Chapter boundary index: the [begin, end) token range of every chapter, split the same way as ChapterScan.
+Only marker tokens can open a chapter, so their positions are collected in parallel and the split rule
+is then applied to that short list.
+*/
+struct MarkerCollector
+{
+    const std::vector<uint32_t> &ids;
+    const std::vector<uint8_t> &categories;
+    std::vector<size_t> positions;
+
+    MarkerCollector(const std::vector<uint32_t> &ids, const std::vector<uint8_t> &categories) : ids(ids), categories(categories) {}
+    MarkerCollector(MarkerCollector &other, tbb::split) : ids(other.ids), categories(other.categories) {}
+
+    void operator()(const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            if (categories[ids[i]] & MARKER)
+            {
+                positions.push_back(i);
+            }
+        }
+    }
+
+    // right-hand ranges always follow this one, so appending keeps the positions sorted
+    void join(const MarkerCollector &right)
+    {
+        positions.insert(positions.end(), right.positions.begin(), right.positions.end());
+    }
+};
+
+auto chapterIndex = [](const std::vector<uint32_t> &ids, const std::vector<uint8_t> &categories, size_t grainSize = 16384)
+{
+    const ScopedTimer timer("chapterIndex");
+    MarkerCollector collector(ids, categories);
+    tbb::parallel_reduce(tbb::blocked_range<size_t>(0, ids.size(), grainSize), collector);
+
+    std::vector<TokenRange> chapters;
+    size_t begin = 0;
+    for (const auto position : collector.positions)
+    {
+        if (startsChapter(MARKER, position - begin))
+        {
+            chapters.emplace_back(begin, position);
+            begin = position;
+        }
+    }
+    if (begin != ids.size())
+    {
+        chapters.emplace_back(begin, ids.size());
+    }
+    return chapters;
+};
+
+// scores one chapter in place: chapter is a view into the book's id storage, nothing is copied
+auto scoreChapterSpan = [](IdSpan chapter, const std::vector<uint8_t> &categories)
+{
+    ChapterCounts counts;
+    for (const auto id : chapter)
+    {
+        counts.add(categories[id]);
+    }
+    return counts;
+};
+
+// phase two: chapters are independent once their ranges are known, every task writes only its own slots
+auto scoreChapterIndex = [](const std::vector<uint32_t> &ids, const std::vector<uint8_t> &categories, const std::vector<TokenRange> &index,
+                            ExecMode exec = ExecMode::Par)
+{
+    const ScopedTimer timer("scoreChapterIndex");
+    std::vector<ChapterCounts> chapters(index.size());
+    withPolicy(exec, [&](auto policy)
+               { std::transform(policy, index.begin(), index.end(), chapters.begin(), [&](TokenRange range)
+                                { return scoreChapterSpan(idSpan(ids, range), categories); }); });
+    return chapters;
+};
+
+// scores chapters of an interned book: every token is a single lookup in the id -> category table
+auto scoreChapters = [](const std::vector<uint32_t> &ids, const std::vector<uint8_t> &categories, DensityMode densityMode = DensityMode::Ratio,
+                        ExecMode exec = ExecMode::Par)
+{
+    return chapterDensities(scoreChapterIndex(ids, categories, chapterIndex(ids, categories), exec), densityMode);
+};
+
+/*
+Size-aware scheduling: work per chapter is proportional to its token count, which the boundary index already knows.
+*/
+enum class Schedule
+{
+    Even,        // chapters in book order, split into equal-count blocks per worker
+    LongestFirst // chapters sorted by length, every task claims the next-longest unscored chapter
+};
+
+struct ScheduledChapters
+{
+    std::vector<ChapterCounts> chapters;
+    std::vector<double> busyMilliseconds; // per worker thread of the arena, idle workers stay 0
+
+    // max / mean busy time over the workers, 1 = perfectly balanced
+    double imbalance() const
+    {
+        const auto total = std::accumulate(busyMilliseconds.begin(), busyMilliseconds.end(), 0.0);
+        return total == 0.0 ? 1.0 : *std::max_element(busyMilliseconds.begin(), busyMilliseconds.end()) / (total / busyMilliseconds.size());
+    }
+};
+
+auto scoreChaptersScheduled = [](const std::vector<uint32_t> &ids, const std::vector<uint8_t> &categories, const std::vector<TokenRange> &index,
+                                 Schedule schedule)
+{
+    const ScopedTimer timer("scoreChaptersScheduled");
+    const auto workers = static_cast<size_t>(tbb::this_task_arena::max_concurrency());
+    ScheduledChapters result{std::vector<ChapterCounts>(index.size()), std::vector<double>(workers, 0.0)};
+
+    // each thread only adds to its own busy slot
+    auto scoreChapter = [&](size_t c)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        result.chapters[c] = scoreChapterSpan(idSpan(ids, index[c]), categories);
+        const auto slot = static_cast<size_t>(tbb::this_task_arena::current_thread_index()) % workers;
+        result.busyMilliseconds[slot] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    if (schedule == Schedule::Even)
+    {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, index.size(), std::max<size_t>(1, index.size() / workers)), [&](const tbb::blocked_range<size_t> &range)
+                          {
+                              for (auto c = range.begin(); c != range.end(); ++c)
+                              {
+                                  scoreChapter(c);
+                              } },
+                          tbb::static_partitioner());
+        return result;
+    }
+
+    // greedy longest-processing-time order; one claiming task per worker, spread by TBB's work stealing,
+    // so a thread that finishes early simply claims the next chapter
+    std::vector<size_t> order(index.size());
+    std::iota(order.begin(), order.end(), size_t{0});
+    std::stable_sort(order.begin(), order.end(), [&index](size_t a, size_t b)
+                     { return index[a].second - index[a].first > index[b].second - index[b].first; });
+    std::atomic<size_t> next{0};
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, workers, 1), [&](const tbb::blocked_range<size_t> &)
+                      {
+                          for (auto claimed = next++; claimed < order.size(); claimed = next++)
+                          {
+                              scoreChapter(order[claimed]);
+                          } },
+                      tbb::simple_partitioner());
+    return result;
+};
+
+auto processChapters = [](const std::vector<std::string> &tokenizedBook, const std::vector<std::string> &warTokens, const std::vector<std::string> &peaceTokens,
+                          MatchMode mode = MatchMode::Exact, DensityMode densityMode = DensityMode::Ratio)
+{
+    const ScopedTimer timer("processChapters");
+    // classify each distinct word once, then every token is a single table lookup
+    const auto interned = internTokens(tokenizedBook);
+    const auto categories = classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, mode);
+
+    return scoreChapters(interned.ids, categories, densityMode);
+};
+
+/*
+Sliding-window density profile: war and peace density of every window of `window` tokens, starting
+every `stride` tokens. Each worker seeds the counters of its first window (the overlap with the
+previous chunk) and then slides them, so the whole series costs O(n + windows * stride) instead of O(windows * window).
+*/
+struct DensitySeries
+{
+    uint64_t window = 0;
+    uint64_t stride = 0;
+    std::vector<float> war; // one value per window
+    std::vector<float> peace;
+};
+
+auto slidingWindowDensity = [](const std::vector<uint32_t> &ids, const std::vector<uint8_t> &categories, size_t window, size_t stride)
+{
+    const ScopedTimer timer("slidingWindowDensity");
+    DensitySeries series;
+    series.window = window;
+    series.stride = stride;
+    if (window == 0 || stride == 0 || ids.size() < window)
+    {
+        return series;
+    }
+
+    const auto windowCount = (ids.size() - window) / stride + 1;
+    series.war.resize(windowCount);
+    series.peace.resize(windowCount);
+
+    // enough windows per chunk that seeding the first window stays a small fraction of the work
+    const auto grainSize = std::max<size_t>(64, window / stride);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, windowCount, grainSize), [&](const tbb::blocked_range<size_t> &range)
+                      {
+                          size_t warHits = 0;
+                          size_t peaceHits = 0;
+                          auto count = [&](size_t position, int delta)
+                          {
+                              const auto category = categories[ids[position]];
+                              warHits += (category & WAR) ? delta : 0;
+                              peaceHits += (category & PEACE) ? delta : 0;
+                          };
+
+                          auto start = range.begin() * stride;
+                          for (auto i = start; i < start + window; ++i)
+                          {
+                              count(i, 1);
+                          }
+
+                          for (auto w = range.begin(); w != range.end(); ++w)
+                          {
+                              if (w != range.begin())
+                              {
+                                  // slide by stride: drop the tokens leaving the window, add the ones entering it
+                                  const auto next = start + stride;
+                                  for (auto i = start; i < std::min(next, start + window); ++i)
+                                  {
+                                      count(i, -1);
+                                  }
+                                  for (auto i = std::max(next, start + window); i < next + window; ++i)
+                                  {
+                                      count(i, 1);
+                                  }
+                                  start = next;
+                              }
+                              series.war[w] = static_cast<float>(warHits) / window;
+                              series.peace[w] = static_cast<float>(peaceHits) / window;
+                          } });
+
+    return series;
+};
+
+// binary layout: "WPDS", uint32 version, uint64 window, stride and count, then count war and count peace floats
+auto writeDensitySeries = [](const DensitySeries &series, const std::string &filename) -> Result<Success>
+{
+    const ScopedTimer timer("writeDensitySeries");
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        return "Error writing to file: " + filename + ". Error opening output file: " + filename;
+    }
+
+    const uint32_t version = 1;
+    const uint64_t count = series.war.size();
+    file.write("WPDS", 4);
+    file.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    file.write(reinterpret_cast<const char *>(&series.window), sizeof(series.window));
+    file.write(reinterpret_cast<const char *>(&series.stride), sizeof(series.stride));
+    file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    file.write(reinterpret_cast<const char *>(series.war.data()), count * sizeof(float));
+    file.write(reinterpret_cast<const char *>(series.peace.data()), count * sizeof(float));
+
+    if (!file)
+    {
+        return "Error writing to file: " + filename;
+    }
+    return Success{};
+};
+
+/*
+Prefix-sum hit index: warHits[i] / peaceHits[i] count the hits among the first i tokens, so the
+density of any token range [begin, end) is two subtractions. Built once with a parallel scan; the
+counts are 64-bit so corpora past 2^32 tokens do not wrap.
+*/
+class HitIndex
+{
+public:
+    HitIndex(const std::vector<uint32_t> &ids, const std::vector<uint8_t> &categories)
+        : warHits(ids.size() + 1, 0), peaceHits(ids.size() + 1, 0)
+    {
+        using Totals = std::pair<uint64_t, uint64_t>;
+        tbb::parallel_scan(
+            tbb::blocked_range<size_t>(0, ids.size(), 16384), Totals{0, 0},
+            [&](const tbb::blocked_range<size_t> &range, Totals totals, bool isFinalScan)
+            {
+                for (auto i = range.begin(); i != range.end(); ++i)
+                {
+                    const auto category = categories[ids[i]];
+                    totals.first += (category & WAR) != 0;
+                    totals.second += (category & PEACE) != 0;
+                    if (isFinalScan)
+                    {
+                        warHits[i + 1] = totals.first;
+                        peaceHits[i + 1] = totals.second;
+                    }
+                }
+                return totals;
+            },
+            [](const Totals &left, const Totals &right)
+            { return Totals{left.first + right.first, left.second + right.second}; });
+    }
+
+    size_t size() const { return warHits.size() - 1; }
+
+    uint64_t hits(Category category, size_t begin, size_t end) const
+    {
+        if (category != WAR && category != PEACE)
+        {
+            throw std::invalid_argument("Hit index only counts WAR and PEACE, not category " + std::to_string(category));
+        }
+        if (begin > end || end > size())
+        {
+            throw std::out_of_range("Token range [" + std::to_string(begin) + ", " + std::to_string(end) + ") outside of index");
+        }
+        const auto &prefix = category == WAR ? warHits : peaceHits;
+        return prefix[end] - prefix[begin];
+    }
+
+    double density(Category category, size_t begin, size_t end) const
+    {
+        const auto count = hits(category, begin, end);
+        return begin == end ? 0.0 : static_cast<double>(count) / (end - begin);
+    }
+
+private:
+    std::vector<uint64_t> warHits;
+    std::vector<uint64_t> peaceHits;
+};
+
+/*
+Incremental rescoring: the per-chapter word histograms are persisted as an inverted index
+(word -> (chapter, count) postings). When the term lists change only words whose category changed
+are visited, and their postings move the chapter hit counts by a delta. Ratio densities computed from
+the adjusted integer counts are identical to a full recompute.
+*/
+struct FileFingerprint
+{
+    uint64_t size = 0;
+    int64_t modified = 0;
+
+    bool operator==(const FileFingerprint &other) const { return size == other.size && modified == other.modified; }
+};
+
+auto fileFingerprint = [](const std::string &filename) -> Result<FileFingerprint>
+{
+    std::error_code error;
+    const auto size = std::filesystem::file_size(filename, error);
+    const auto modified = std::filesystem::last_write_time(filename, error);
+    if (error)
+    {
+        return "Error reading file status: " + filename + ". " + error.message();
+    }
+    return FileFingerprint{size, static_cast<int64_t>(modified.time_since_epoch().count())};
+};
+
+struct ChapterTotals
+{
+    uint32_t words = 0;
+    uint32_t warHits = 0;
+    uint32_t peaceHits = 0;
+};
+
+struct ScoringState
+{
+    FileFingerprint book;
+    MatchMode matchMode = MatchMode::Exact;
+    std::vector<ChapterTotals> chapters;
+    Vocabulary vocabulary;
+    std::vector<uint8_t> categories;                      // categories the chapter totals were computed with
+    std::vector<uint32_t> postingOffsets;                 // postings of word id are [postingOffsets[id], postingOffsets[id + 1])
+    std::vector<std::pair<uint32_t, uint32_t>> postings; // (chapter, count)
+};
+
+auto buildScoringState = [](InternedTokens interned, std::vector<uint8_t> categories, MatchMode matchMode, FileFingerprint book)
+{
+    const ScopedTimer timer("buildScoringState");
+    ScoringState state;
+    state.book = book;
+    state.matchMode = matchMode;
+
+    const auto histograms = chapterHistograms(interned.ids, categories);
+    std::vector<uint32_t> postingCounts(categories.size(), 0);
+    for (const auto &histogram : histograms)
+    {
+        ChapterTotals totals;
+        for (const auto &[id, count] : histogram)
+        {
+            totals.words += count;
+            totals.warHits += (categories[id] & WAR) ? count : 0;
+            totals.peaceHits += (categories[id] & PEACE) ? count : 0;
+            postingCounts[id]++;
+        }
+        state.chapters.push_back(totals);
+    }
+
+    // counting sort of the histograms into one posting array per word
+    state.postingOffsets.assign(categories.size() + 1, 0);
+    std::partial_sum(postingCounts.begin(), postingCounts.end(), state.postingOffsets.begin() + 1);
+    state.postings.resize(state.postingOffsets.back());
+    auto next = std::vector<uint32_t>(state.postingOffsets.begin(), state.postingOffsets.end() - 1);
+    for (uint32_t chapter = 0; chapter < histograms.size(); ++chapter)
+    {
+        for (const auto &[id, count] : histograms[chapter])
+        {
+            state.postings[next[id]++] = {chapter, count};
+        }
+    }
+
+    state.vocabulary = std::move(interned.vocabulary);
+    state.categories = std::move(categories);
+    return state;
+};
+
+auto rescoreState = [](ScoringState state, const std::vector<std::string> &warTokens, const std::vector<std::string> &peaceTokens)
+{
+    const ScopedTimer timer("rescoreState");
+    const auto categories = classifyVocabulary(state.vocabulary, warTokens, peaceTokens, state.matchMode);
+
+    for (uint32_t id = 0; id < categories.size(); ++id)
+    {
+        const auto changed = categories[id] ^ state.categories[id];
+        if (changed == 0)
+        {
+            continue;
+        }
+        for (auto p = state.postingOffsets[id]; p != state.postingOffsets[id + 1]; ++p)
+        {
+            const auto &[chapter, count] = state.postings[p];
+            auto &totals = state.chapters[chapter];
+            if (changed & WAR)
+            {
+                totals.warHits = (categories[id] & WAR) ? totals.warHits + count : totals.warHits - count;
+            }
+            if (changed & PEACE)
+            {
+                totals.peaceHits = (categories[id] & PEACE) ? totals.peaceHits + count : totals.peaceHits - count;
+            }
+        }
+    }
+
+    state.categories = categories;
+    return state;
+};
+
+auto stateDensities = [](const ScoringState &state)
+{
+    std::vector<double> warDensities(state.chapters.size());
+    std::vector<double> peaceDensities(state.chapters.size());
+    std::transform(state.chapters.begin(), state.chapters.end(), warDensities.begin(), [](const ChapterTotals &totals)
+                   { return totals.words == 0 ? 0.0 : static_cast<double>(totals.warHits) / totals.words; });
+    std::transform(state.chapters.begin(), state.chapters.end(), peaceDensities.begin(), [](const ChapterTotals &totals)
+                   { return totals.words == 0 ? 0.0 : static_cast<double>(totals.peaceHits) / totals.words; });
+    return std::make_pair(warDensities, peaceDensities);
+};
+
+template <typename T>
+void writeValue(std::ostream &out, const T &value) { out.write(reinterpret_cast<const char *>(&value), sizeof(T)); }
+
+template <typename T>
+void writeArray(std::ostream &out, const std::vector<T> &values)
+{
+    writeValue(out, static_cast<uint64_t>(values.size()));
+    out.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
+}
+
+template <typename T>
+T readValue(std::istream &in)
+{
+    T value{};
+    in.read(reinterpret_cast<char *>(&value), sizeof(T));
+    return value;
+}
+
+template <typename T>
+std::vector<T> readArray(std::istream &in)
+{
+    std::vector<T> values(readValue<uint64_t>(in));
+    in.read(reinterpret_cast<char *>(values.data()), values.size() * sizeof(T));
+    return values;
+}
+
+auto writeScoringState = [](const ScoringState &state, const std::string &filename) -> Result<Success>
+{
+    const ScopedTimer timer("writeScoringState");
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        return "Error writing to file: " + filename + ". Error opening output file: " + filename;
+    }
+
+    file.write("WPSC", 4);
+    writeValue(file, uint32_t{1});
+    writeValue(file, state.book);
+    writeValue(file, static_cast<uint8_t>(state.matchMode));
+    writeArray(file, state.chapters);
+    writeValue(file, static_cast<uint64_t>(state.vocabulary.size()));
+    for (uint32_t id = 0; id < state.vocabulary.size(); ++id)
+    {
+        const auto word = state.vocabulary.word(id);
+        writeValue(file, static_cast<uint32_t>(word.size()));
+        file.write(word.data(), word.size());
+    }
+    writeArray(file, state.categories);
+    writeArray(file, state.postingOffsets);
+    writeArray(file, state.postings);
+
+    if (!file)
+    {
+        return "Error writing to file: " + filename;
+    }
+    return Success{};
+};
+
+auto readScoringState = [](const std::string &filename) -> Result<ScoringState>
+{
+    const ScopedTimer timer("readScoringState");
+    std::ifstream file(filename, std::ios::binary);
+    char magic[4] = {};
+    file.read(magic, 4);
+    if (!file || std::string(magic, 4) != "WPSC" || readValue<uint32_t>(file) != 1)
+    {
+        return "Error reading scoring state: " + filename;
+    }
+
+    ScoringState state;
+    state.book = readValue<FileFingerprint>(file);
+    state.matchMode = static_cast<MatchMode>(readValue<uint8_t>(file));
+    state.chapters = readArray<ChapterTotals>(file);
+    const auto vocabularySize = readValue<uint64_t>(file);
+    std::string word;
+    for (uint64_t id = 0; id < vocabularySize && file; ++id)
+    {
+        word.resize(readValue<uint32_t>(file));
+        file.read(word.data(), word.size());
+        state.vocabulary.intern(word);
+    }
+    state.categories = readArray<uint8_t>(file);
+    state.postingOffsets = readArray<uint32_t>(file);
+    state.postings = readArray<std::pair<uint32_t, uint32_t>>(file);
+
+    if (!file || state.categories.size() != vocabularySize || state.postingOffsets.size() != vocabularySize + 1)
+    {
+        return "Error reading scoring state: " + filename;
+    }
+    // rescoring indexes chapters and postings with these values without further checks
+    const auto offsetsValid = state.vocabulary.size() == vocabularySize && state.postingOffsets.front() == 0 &&
+                              std::is_sorted(state.postingOffsets.begin(), state.postingOffsets.end()) && state.postingOffsets.back() == state.postings.size();
+    const auto chaptersValid = std::all_of(state.postings.begin(), state.postings.end(), [&state](const std::pair<uint32_t, uint32_t> &posting)
+                                           { return posting.first < state.chapters.size(); });
+    if (!offsetsValid || !chaptersValid)
+    {
+        return "Corrupt scoring state: " + filename;
+    }
+    return state;
+};
+
+/*
+Append mode for growing documents: the state remembers how many bytes of the book were consumed
+(always up to a line end) and the chapter scan at that point. The next run only tokenizes and scores
+the bytes appended since, continuing the open chapter. A checksum of the bytes just before the offset
+and of the term lists detects rewritten books or edited terms, which restart from the beginning.
+*/
+auto fnv1a = [](std::string_view bytes, uint64_t hash = 0xCBF29CE484222325ULL)
+{
+    for (const auto c : bytes)
+    {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001B3ULL;
+    }
+    return hash;
+};
+
+struct AppendState
+{
+    uint64_t offset = 0;     // bytes consumed, just after a '\n'
+    uint64_t prefixHash = 0; // hash of up to 4 KiB before offset
+    uint64_t termsHash = 0;
+    ChapterScan scan;
+};
+
+auto termsHash = [](const std::vector<std::string> &warTokens, const std::vector<std::string> &peaceTokens, MatchMode mode, DensityMode densityMode)
+{
+    auto hash = fnv1a(std::string{static_cast<char>(mode), static_cast<char>(densityMode)});
+    for (const auto *terms : {&warTokens, &peaceTokens})
+    {
+        for (const auto &term : *terms)
+        {
+            hash = fnv1a(term + '\n', hash);
+        }
+        hash = fnv1a(std::string_view("\0", 1), hash); // ends the list, so a term moved to the other list changes the hash
+    }
+    return hash;
+};
+
+auto readFileRange = [](const std::string &filename, uint64_t begin, uint64_t end) -> Result<std::vector<char>>
+{
+    const ScopedTimer timer("readFileRange");
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        return "Error opening or reading file: " + filename;
+    }
+    std::vector<char> bytes(end - begin);
+    file.seekg(static_cast<std::streamoff>(begin));
+    file.read(bytes.data(), bytes.size());
+    if (!file)
+    {
+        return "Error opening or reading file: " + filename;
+    }
+    return bytes;
+};
+
+auto readWholeFile = [](const std::string &filename) -> Result<std::vector<char>>
+{
+    const ScopedTimer timer("readWholeFile");
+    const auto size = fileFingerprint(filename);
+    if (auto err = std::get_if<std::string>(&size))
+    {
+        return *err;
+    }
+    return readFileRange(filename, 0, std::get<FileFingerprint>(size).size);
+};
+
+auto scanText = [](ChapterScan &scan, std::string_view text, const std::vector<std::string> &warTokens, const std::vector<std::string> &peaceTokens, MatchMode mode)
+{
+    InternedTokens interned;
+    forEachToken(text, [&interned](std::string_view token)
+                 { interned.ids.push_back(interned.vocabulary.intern(token)); });
+    const auto categories = classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, mode);
+    for (const auto id : interned.ids)
+    {
+        scan.add(categories[id]);
+    }
+};
+
+// returns the advanced state and the chapters of the whole book as it is now
+auto appendScore = [](AppendState state, const std::string &filename, const std::vector<std::string> &warTokens, const std::vector<std::string> &peaceTokens,
+                      MatchMode mode, DensityMode densityMode) -> Result<std::pair<AppendState, std::vector<ChapterCounts>>>
+{
+    const ScopedTimer timer("appendScore");
+    const auto fingerprint = fileFingerprint(filename);
+    if (auto err = std::get_if<std::string>(&fingerprint))
+    {
+        return *err;
+    }
+    const auto size = std::get<FileFingerprint>(fingerprint).size;
+    const auto terms = termsHash(warTokens, peaceTokens, mode, densityMode);
+
+    auto hashBefore = [&filename](uint64_t offset) -> Result<uint64_t>
+    {
+        const auto bytes = readFileRange(filename, offset - std::min<uint64_t>(offset, 4096), offset);
+        if (auto err = std::get_if<std::string>(&bytes))
+        {
+            return *err;
+        }
+        return fnv1a(std::string_view(std::get<std::vector<char>>(bytes).data(), std::get<std::vector<char>>(bytes).size()));
+    };
+
+    // start over unless the file still begins with what was consumed and the terms are the same
+    const auto previousHash = state.offset <= size ? hashBefore(state.offset) : Result<uint64_t>(std::string("truncated"));
+    if (state.termsHash != terms || std::get_if<uint64_t>(&previousHash) == nullptr || std::get<uint64_t>(previousHash) != state.prefixHash)
+    {
+        state = AppendState{};
+    }
+    state.termsHash = terms;
+
+    const auto tail = readFileRange(filename, state.offset, size);
+    if (auto err = std::get_if<std::string>(&tail))
+    {
+        return *err;
+    }
+    const std::string_view appended(std::get<std::vector<char>>(tail).data(), std::get<std::vector<char>>(tail).size());
+
+    // only whole lines are committed to the state, a trailing partial line is scored on a copy
+    const auto committed = appended.rfind('\n') == std::string_view::npos ? 0 : appended.rfind('\n') + 1;
+    scanText(state.scan, appended.substr(0, committed), warTokens, peaceTokens, mode);
+    auto current = state.scan;
+    scanText(current, appended.substr(committed), warTokens, peaceTokens, mode);
+
+    state.offset += committed;
+    const auto prefixHash = hashBefore(state.offset);
+    if (auto err = std::get_if<std::string>(&prefixHash))
+    {
+        return *err;
+    }
+    state.prefixHash = std::get<uint64_t>(prefixHash);
+
+    return std::make_pair(std::move(state), current.chapters());
+};
+
+auto writeAppendState = [](const AppendState &state, const std::string &filename) -> Result<Success>
+{
+    const ScopedTimer timer("writeAppendState");
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        return "Error writing to file: " + filename + ". Error opening output file: " + filename;
+    }
+
+    file.write("WPAP", 4);
+    writeValue(file, uint32_t{2}); // version 2: fixed-point proximity
+    writeValue(file, state.offset);
+    writeValue(file, state.prefixHash);
+    writeValue(file, state.termsHash);
+    writeArray(file, state.scan.closed);
+    writeValue(file, state.scan.open);
+
+    if (!file)
+    {
+        return "Error writing to file: " + filename;
+    }
+    return Success{};
+};
+
+auto readAppendState = [](const std::string &filename) -> Result<AppendState>
+{
+    const ScopedTimer timer("readAppendState");
+    std::ifstream file(filename, std::ios::binary);
+    char magic[4] = {};
+    file.read(magic, 4);
+    if (!file || std::string(magic, 4) != "WPAP" || readValue<uint32_t>(file) != 2)
+    {
+        return "Error reading append state: " + filename;
+    }
+
+    AppendState state;
+    state.offset = readValue<uint64_t>(file);
+    state.prefixHash = readValue<uint64_t>(file);
+    state.termsHash = readValue<uint64_t>(file);
+    state.scan.closed = readArray<ChapterCounts>(file);
+    state.scan.open = readValue<ChapterCounts>(file);
+
+    if (!file)
+    {
+        return "Error reading append state: " + filename;
+    }
+    return state;
+};
+
+/*
+Split-anywhere parallel scoring: the book is cut into fixed-size byte chunks that ignore chapter and
+even word boundaries. Each chunk is summarized independently and summaries combine associatively:
+
+ChapterPieces is the token-level summary: the counts of the tokens before the first marker (a prefix
+fragment that continues whatever chapter is open on the left), then every marker with the counts of
+the tokens up to the next marker (complete chapters, the last one being the open suffix fragment).
+Whether a marker really splits depends on the size of the chapter open before it, so that decision is
+only made by ChapterScan when the pieces are folded in book order, which costs O(chapters).
+
+ChunkSummary adds the byte edges: a partial token at either end that may continue in the neighbour,
+and the first/last byte for the rule that a line starting with a delimiter yields an empty token.
+*/
+struct ChapterPieces
+{
+    ChapterCounts leading;
+    std::vector<std::pair<uint8_t, ChapterCounts>> pieces; // marker category, counts of the tokens after it
+
+    void add(uint8_t category)
+    {
+        if (category & MARKER)
+        {
+            pieces.emplace_back(category, ChapterCounts{});
+        }
+        else
+        {
+            (pieces.empty() ? leading : pieces.back().second).add(category);
+        }
+    }
+
+    void append(const ChapterPieces &right)
+    {
+        (pieces.empty() ? leading : pieces.back().second).merge(right.leading);
+        pieces.insert(pieces.end(), right.pieces.begin(), right.pieces.end());
+    }
+};
+
+// folds pieces into the scan in book order; this is where the chapter split rule is applied
+auto scanPieces = [](ChapterScan &scan, const ChapterPieces &pieces)
+{
+    scan.open.merge(pieces.leading);
+    for (const auto &[marker, body] : pieces.pieces)
+    {
+        scan.add(marker);
+        scan.open.merge(body);
+    }
+};
+
+struct ChunkSummary
+{
+    size_t size = 0;
+    bool hasDelimiter = false; // without one the whole chunk is part of a single token, kept in head
+    char firstByte = 0;
+    char lastByte = 0;
+    std::string head; // non-delimiter bytes at the start
+    std::string tail; // non-delimiter bytes at the end
+    ChapterPieces tokens;
+};
+
+auto summarizeChunk = [](std::string_view bytes, const TermClassifier &classifier)
+{
+    const ScopedTimer timer("summarizeChunk");
+    ChunkSummary summary;
+    summary.size = bytes.size();
+    if (bytes.empty())
+    {
+        return summary;
+    }
+    summary.firstByte = bytes.front();
+    summary.lastByte = bytes.back();
+
+    const auto first = std::find_if(bytes.begin(), bytes.end(), isDelimiter) - bytes.begin();
+    if (static_cast<size_t>(first) == bytes.size())
+    {
+        summary.head = std::string(bytes);
+        return summary;
+    }
+    const auto last = bytes.rend() - std::find_if(bytes.rbegin(), bytes.rend(), isDelimiter) - 1;
+
+    summary.hasDelimiter = true;
+    summary.head = std::string(bytes.substr(0, first));
+    summary.tail = std::string(bytes.substr(last + 1));
+
+    // classify each distinct word of the chunk once
+    FlatStringMap<uint8_t> cache;
+    forEachToken(
+        bytes.substr(first, last - first + 1), [&](std::string_view token)
+        {
+            const auto [entry, inserted] = cache.tryEmplace(token, NONE);
+            if (inserted)
+            {
+                entry.value = classifier.classify(token);
+            }
+            summary.tokens.add(entry.value); },
+        false);
+
+    return summary;
+};
+
+auto combineChunks = [](ChunkSummary left, const ChunkSummary &right, const TermClassifier &classifier)
+{
+    const ScopedTimer timer("combineChunks");
+    if (right.size == 0)
+    {
+        return left;
+    }
+    if (left.size == 0)
+    {
+        return right;
+    }
+
+    const auto leftLastByte = std::exchange(left.lastByte, right.lastByte);
+    left.size += right.size;
+    if (!left.hasDelimiter)
+    {
+        // left is a piece of the token that continues into right
+        left.head += right.head;
+        left.hasDelimiter = right.hasDelimiter;
+        left.tail = right.tail;
+        left.tokens = right.tokens;
+        return left;
+    }
+    if (!right.hasDelimiter)
+    {
+        left.tail += right.head;
+        return left;
+    }
+
+    // the token cut by the chunk boundary, or the empty token of a line that starts with a delimiter
+    const auto joined = left.tail + right.head;
+    if (!joined.empty())
+    {
+        left.tokens.add(classifier.classify(joined));
+    }
+    else if (leftLastByte == '\n' && right.firstByte != '\n' && isDelimiter(right.firstByte))
+    {
+        left.tokens.add(classifier.classify(""));
+    }
+    left.tokens.append(right.tokens);
+    left.tail = right.tail;
+    return left;
+};
+
+// scores the whole book from byte chunks summarized in parallel; a line break on both sides turns
+// the partial tokens at the book's edges into complete ones
+auto scoreChunked = [](std::string_view book, const TermClassifier &classifier, size_t chunkSize)
+{
+    const ScopedTimer timer("scoreChunked");
+    chunkSize = std::max<size_t>(1, chunkSize);
+    const auto chunkCount = (book.size() + chunkSize - 1) / chunkSize;
+
+    const auto summary = tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, chunkCount), ChunkSummary{},
+        [&](const tbb::blocked_range<size_t> &range, ChunkSummary accumulated)
+        {
+            for (auto chunk = range.begin(); chunk != range.end(); ++chunk)
+            {
+                accumulated = combineChunks(std::move(accumulated), summarizeChunk(book.substr(chunk * chunkSize, chunkSize), classifier), classifier);
+            }
+            return accumulated;
+        },
+        [&classifier](const ChunkSummary &left, const ChunkSummary &right)
+        { return combineChunks(left, right, classifier); });
+
+    const auto lineBreak = summarizeChunk("\n", classifier);
+    const auto whole = combineChunks(combineChunks(lineBreak, summary, classifier), lineBreak, classifier);
+
+    ChapterScan scan;
+    scanPieces(scan, whole.tokens);
+    return scan.chapters();
+};
+
+/*
+Pipelined scoring: a serial stage reads the next chunk of the file, chunks are summarized in parallel, and a
+serial in-order stage combines each summary with the carry and folds the finished pieces into the chapter scan.
+Reading overlaps with summarizing, and at most maxLiveChunks chunks exist at any time, so memory stays bounded
+by maxLiveChunks * chunkBytes however large the book is.
+*/
+auto scorePipelined = [](const std::string &filename, const TermClassifier &classifier, size_t chunkBytes, size_t maxLiveChunks)
+    -> Result<std::vector<ChapterCounts>>
+{
+    const ScopedTimer timer("scorePipelined");
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        return "Error opening file: " + filename;
+    }
+    chunkBytes = std::max<size_t>(1, chunkBytes);
+
+    // a line break before the book, like in scoreChunked
+    const auto lineBreak = summarizeChunk("\n", classifier);
+    auto carry = lineBreak;
+    ChapterScan scan;
+
+    tbb::parallel_pipeline(
+        std::max<size_t>(1, maxLiveChunks),
+        tbb::make_filter<void, std::string>(tbb::filter_mode::serial_in_order,
+                                            [&](tbb::flow_control &control)
+                                            {
+                                                std::string chunk(chunkBytes, '\0');
+                                                file.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+                                                chunk.resize(static_cast<size_t>(file.gcount()));
+                                                if (chunk.empty())
+                                                {
+                                                    control.stop();
+                                                }
+                                                return chunk;
+                                            }) &
+            tbb::make_filter<std::string, ChunkSummary>(tbb::filter_mode::parallel, [&classifier](const std::string &chunk)
+                                                        { return summarizeChunk(chunk, classifier); }) &
+            tbb::make_filter<ChunkSummary, void>(tbb::filter_mode::serial_in_order, [&](const ChunkSummary &summary)
+                                                 {
+                                                     // only the cut token stays in the carry, finished pieces go to the scan
+                                                     carry = combineChunks(std::move(carry), summary, classifier);
+                                                     scanPieces(scan, carry.tokens);
+                                                     carry.tokens = ChapterPieces{}; }));
+
+    if (file.bad())
+    {
+        return "Error reading file: " + filename;
+    }
+    scanPieces(scan, combineChunks(std::move(carry), lineBreak, classifier).tokens);
+    return scan.chapters();
+};
+
+/*
+Structure index: byte offsets of the part headings (BOOK ..., ... EPILOGUE) and of the chapters inside each part,
+found by a substring scan over the raw buffer. Any section can then be scored from its bytes alone.
+*/
+// offsets of every occurrence of needle: SSE2 compares the first and last needle byte at 16 positions
+// at once and only the candidates where both match are verified
+auto findOccurrences = [](std::string_view text, std::string_view needle)
+{
+    std::vector<size_t> positions;
+    if (needle.empty() || needle.size() > text.size())
+    {
+        return positions;
+    }
+
+    size_t i = 0;
+#if defined(__SSE2__)
+    const auto first = _mm_set1_epi8(needle.front());
+    const auto last = _mm_set1_epi8(needle.back());
+    for (; i + needle.size() - 1 + 16 <= text.size(); i += 16)
+    {
+        const auto blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text.data() + i));
+        const auto blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text.data() + i + needle.size() - 1));
+        auto candidates = static_cast<uint32_t>(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last))));
+        while (candidates != 0)
+        {
+            const auto position = i + __builtin_ctz(candidates);
+            if (text.compare(position, needle.size(), needle) == 0)
+            {
+                positions.push_back(position);
+            }
+            candidates &= candidates - 1;
+        }
+    }
+#endif
+    for (; i + needle.size() <= text.size(); ++i)
+    {
+        if (text.compare(i, needle.size(), needle) == 0)
+        {
+            positions.push_back(i);
+        }
+    }
+    return positions;
+};
+
+enum class SectionKind : uint8_t
+{
+    Book,
+    Epilogue,
+    Chapter,
+    Volume
+};
+
+struct Section
+{
+    SectionKind kind = SectionKind::Book;
+    std::string title;             // heading line, e.g. "BOOK TWO: 1805"; empty for the part before the first part heading
+    size_t begin = 0;              // byte offset of the heading
+    size_t end = 0;                // byte offset of the next heading of the same or a higher level
+    std::vector<Section> chapters; // parts only
+};
+
+struct StructureIndex
+{
+    std::vector<Section> parts;   // books and epilogues in text order
+    std::vector<Section> volumes; // VOLUME headings in text order, empty if the text has none; they hold no parts
+
+    size_t chapterCount() const
+    {
+        return std::accumulate(parts.begin(), parts.end(), size_t{0}, [](size_t sum, const Section &part)
+                               { return sum + part.chapters.size(); });
+    }
+
+    // 1-based part and chapter within it, chapter 0 = the whole part; nullptr if there is no such section
+    const Section *find(size_t part, size_t chapter) const
+    {
+        if (part == 0 || part > parts.size() || chapter > parts[part - 1].chapters.size())
+        {
+            return nullptr;
+        }
+        return chapter == 0 ? &parts[part - 1] : &parts[part - 1].chapters[chapter - 1];
+    }
+};
+
+// a heading is a line that holds one of the markers and no lowercase letter, so "CHAPTER" in running text never counts
+auto buildStructureIndex = [](std::string_view text)
+{
+    const ScopedTimer timer("buildStructureIndex");
+    std::vector<std::pair<size_t, SectionKind>> headings; // line start, kind
+    for (const auto &[marker, kind] : {std::make_pair("CHAPTER", SectionKind::Chapter), std::make_pair("BOOK", SectionKind::Book),
+                                       std::make_pair("EPILOGUE", SectionKind::Epilogue), std::make_pair("VOLUME", SectionKind::Volume)})
+    {
+        for (const auto position : findOccurrences(text, marker))
+        {
+            const auto lineBegin = text.rfind('\n', position) == std::string_view::npos ? 0 : text.rfind('\n', position) + 1;
+            const auto lineEnd = std::min(text.find('\n', position), text.size());
+            const auto line = text.substr(lineBegin, lineEnd - lineBegin);
+            if (std::none_of(line.begin(), line.end(), [](unsigned char c)
+                             { return std::islower(c); }))
+            {
+                headings.emplace_back(lineBegin, kind);
+            }
+        }
+    }
+    std::sort(headings.begin(), headings.end());
+    headings.erase(std::unique(headings.begin(), headings.end(), [](const auto &a, const auto &b)
+                               { return a.first == b.first; }),
+                   headings.end());
+
+    StructureIndex index;
+    for (const auto &[begin, kind] : headings)
+    {
+        const auto lineEnd = std::min(text.find('\n', begin), text.size());
+        auto title = std::string(text.substr(begin, lineEnd - begin));
+        title.erase(std::find_if(title.rbegin(), title.rend(), [](unsigned char c)
+                                 { return !std::isspace(c); })
+                        .base(),
+                    title.end());
+
+        if (kind == SectionKind::Chapter)
+        {
+            // chapters before the first part heading, or right after a volume heading, get an untitled part
+            if (index.parts.empty() || index.parts.back().end != 0)
+            {
+                index.parts.push_back(Section{SectionKind::Book, "", index.parts.empty() ? 0 : begin, 0, {}});
+            }
+            auto &chapters = index.parts.back().chapters;
+            if (!chapters.empty())
+            {
+                chapters.back().end = begin;
+            }
+            chapters.push_back(Section{kind, std::move(title), begin, 0, {}});
+        }
+        else
+        {
+            if (!index.parts.empty())
+            {
+                index.parts.back().end = begin;
+                if (!index.parts.back().chapters.empty())
+                {
+                    index.parts.back().chapters.back().end = begin;
+                }
+            }
+            auto &level = kind == SectionKind::Volume ? index.volumes : index.parts;
+            if (kind == SectionKind::Volume && !level.empty())
+            {
+                level.back().end = begin;
+            }
+            level.push_back(Section{kind, std::move(title), begin, 0, {}});
+        }
+    }
+    if (!index.parts.empty() && index.parts.back().end == 0)
+    {
+        index.parts.back().end = text.size();
+        if (!index.parts.back().chapters.empty())
+        {
+            index.parts.back().chapters.back().end = text.size();
+        }
+    }
+    if (!index.volumes.empty())
+    {
+        index.volumes.back().end = text.size();
+    }
+    return index;
+};
+
+// counts of one section, tokenized straight from its bytes
+auto scoreSection = [](std::string_view text, const Section &section, const TermClassifier &classifier)
+{
+    const ScopedTimer timer("scoreSection");
+    ChapterCounts counts;
+    forEachToken(text.substr(section.begin, section.end - section.begin), [&](std::string_view token)
+                 { counts.add(classifier.classify(token)); });
+    return counts;
+};
+
+/*
+Rollups: per-part, per-volume and corpus statistics merged bottom-up from the chapter counts of the same run.
+Counts are summed (and spacing states combined), so an aggregate's density is that of its whole text rather than
+an average of chapter densities, and the extra cost is O(chapters).
+*/
+struct Rollup
+{
+    std::string name;
+    size_t chapters = 0;
+    ChapterCounts counts;
+};
+
+// merges consecutive runs of items, the g-th rollup taking groupSizes[g] of them
+auto rollupGroups = [](const std::vector<Rollup> &items, const std::vector<size_t> &groupSizes, const std::function<std::string(size_t)> &name)
+{
+    std::vector<Rollup> groups;
+    auto next = items.begin();
+    for (const auto size : groupSizes)
+    {
+        Rollup group{name(groups.size()), 0, {}};
+        std::for_each(next, next + size, [&group](const Rollup &item)
+                      {
+                          group.chapters += item.chapters;
+                          group.counts.merge(item.counts); });
+        next += size;
+        groups.push_back(std::move(group));
+    }
+    return groups;
+};
+
+// chapters are assigned to the parts of the structure index in order; the scan opens one chapter before the first
+// heading (empty if the text starts with it), which belongs to the first part, and part headings go to the chapter
+// before them. A volume holds the parts that start between its heading and the next one, parts before the first
+// volume heading go to the first volume; texts without volume headings get no volume level
+auto rollupChapters = [](const std::vector<ChapterCounts> &chapters, const StructureIndex &structure) -> Result<std::vector<Rollup>>
+{
+    const ScopedTimer timer("rollupChapters");
+    if (structure.parts.empty() || chapters.size() != structure.chapterCount() + 1)
+    {
+        return "Cannot assign " + std::to_string(chapters.size()) + " scored chapters to " + std::to_string(structure.chapterCount()) +
+               " chapter headings, expected one more scored chapter than headings";
+    }
+
+    std::vector<Rollup> items(chapters.size());
+    std::transform(chapters.begin(), chapters.end(), items.begin(), [](const ChapterCounts &counts)
+                   { return Rollup{"", 1, counts}; });
+
+    std::vector<size_t> partSizes(structure.parts.size());
+    std::transform(structure.parts.begin(), structure.parts.end(), partSizes.begin(), [](const Section &part)
+                   { return part.chapters.size(); });
+    partSizes.front() += 1;
+
+    auto result = rollupGroups(items, partSizes, [&structure](size_t part)
+                               { return structure.parts[part].title.empty() ? std::string("(untitled part)") : structure.parts[part].title; });
+    const auto parts = result;
+
+    if (!structure.volumes.empty())
+    {
+        std::vector<size_t> volumeParts(structure.volumes.size(), 0);
+        for (const auto &part : structure.parts)
+        {
+            const auto next = std::upper_bound(structure.volumes.begin(), structure.volumes.end(), part.begin, [](size_t begin, const Section &volume)
+                                               { return begin < volume.begin; });
+            volumeParts[next == structure.volumes.begin() ? 0 : next - structure.volumes.begin() - 1]++;
+        }
+        const auto volumes = rollupGroups(parts, volumeParts, [&structure](size_t volume)
+                                          { return structure.volumes[volume].title; });
+        result.insert(result.end(), volumes.begin(), volumes.end());
+    }
+
+    const auto corpus = rollupGroups(parts, {parts.size()}, [](size_t)
+                                     { return std::string("Corpus"); });
+    result.insert(result.end(), corpus.begin(), corpus.end());
+    return result;
+};
+
+auto writeRollups = [](const std::vector<Rollup> &rollups, DensityMode densityMode, const std::string &filename) -> Result<Success>
+{
+    const ScopedTimer timer("writeRollups");
+    std::ofstream file(filename);
+    if (!file)
+    {
+        return "Error writing to file: " + filename;
+    }
+    for (const auto &rollup : rollups)
+    {
+        const auto war = rollup.counts.warDensity(densityMode);
+        const auto peace = rollup.counts.peaceDensity(densityMode);
+        file << rollup.name << ": " << rollup.chapters << " chapters, " << rollup.counts.words << " words, war density " << war
+             << ", peace density " << peace << ", " << (war > peace ? "war-related" : "peace-related") << '\n';
+    }
+    return Success{};
+};
+
+/*
+Paragraph mode: every blank-line separated paragraph is scored as its own unit. Paragraphs are counted straight from
+the bytes with a per-piece word category cache, so a new unit costs one push_back and a reset of its counters.
+Unlike the chapter scan, the empty tokens of lines that start with a delimiter are not counted as words.
+*/
+auto isBlankLine = [](std::string_view line)
+{
+    return std::all_of(line.begin(), line.end(), [](char c)
+                       { return c == ' ' || c == '\t' || c == '\r'; });
+};
+
+// start of the first blank line that begins after from, or text.size(); pieces cut there never split a paragraph
+auto nextParagraphBreak = [](std::string_view text, size_t from)
+{
+    for (auto newline = text.find('\n', from); newline != std::string_view::npos;)
+    {
+        const auto lineBegin = newline + 1;
+        newline = text.find('\n', lineBegin);
+        if (isBlankLine(text.substr(lineBegin, (newline == std::string_view::npos ? text.size() : newline) - lineBegin)))
+        {
+            return std::min(lineBegin, text.size());
+        }
+    }
+    return text.size();
+};
+
+// paragraphs of a piece of text that begins at a line start
+auto scanParagraphs = [](std::string_view text, const TermClassifier &classifier)
+{
+    const ScopedTimer timer("scanParagraphs");
+    std::vector<ChapterCounts> paragraphs;
+    FlatStringMap<uint8_t> cache;
+    ChapterCounts current;
+    for (size_t lineBegin = 0; lineBegin < text.size();)
+    {
+        const auto lineEnd = std::min(text.find('\n', lineBegin), text.size());
+        const auto line = text.substr(lineBegin, lineEnd - lineBegin);
+        if (isBlankLine(line))
+        {
+            if (current.words != 0)
+            {
+                paragraphs.push_back(current);
+                current = ChapterCounts{};
+            }
+        }
+        else
+        {
+            forEachToken(line, [&](std::string_view token)
+                         {
+                             if (token.empty())
+                             {
+                                 return;
+                             }
+                             const auto [entry, inserted] = cache.tryEmplace(token, NONE);
+                             if (inserted)
+                             {
+                                 entry.value = classifier.classify(token);
+                             }
+                             current.add(entry.value); });
+        }
+        lineBegin = lineEnd + 1;
+    }
+    if (current.words != 0)
+    {
+        paragraphs.push_back(current);
+    }
+    return paragraphs;
+};
+
+// the text is cut at blank lines into pieces of about pieceBytes, scanned in parallel and concatenated in order
+auto scoreParagraphs = [](std::string_view text, const TermClassifier &classifier, size_t pieceBytes = 1 << 18)
+{
+    const ScopedTimer timer("scoreParagraphs");
+    std::vector<size_t> cuts = {0};
+    while (cuts.back() < text.size())
+    {
+        cuts.push_back(nextParagraphBreak(text, cuts.back() + std::max<size_t>(1, pieceBytes)));
+    }
+
+    std::vector<std::vector<ChapterCounts>> pieces(cuts.size() - 1);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, pieces.size(), 1), [&](const tbb::blocked_range<size_t> &range)
+                      {
+                          for (auto piece = range.begin(); piece != range.end(); ++piece)
+                          {
+                              pieces[piece] = scanParagraphs(text.substr(cuts[piece], cuts[piece + 1] - cuts[piece]), classifier);
+                          } });
+
+    std::vector<ChapterCounts> paragraphs;
+    paragraphs.reserve(std::accumulate(pieces.begin(), pieces.end(), size_t{0}, [](size_t sum, const std::vector<ChapterCounts> &piece)
+                                       { return sum + piece.size(); }));
+    for (const auto &piece : pieces)
+    {
+        paragraphs.insert(paragraphs.end(), piece.begin(), piece.end());
+    }
+    return paragraphs;
+};
+
+/*
+Approximate counting: fixed-memory sketches for corpora whose vocabulary does not fit in memory.
+*/
+inline uint64_t mixHash(uint64_t x) // splitmix64 finalizer
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Count-Min sketch: depth rows of width counters. With width = ceil(e / epsilon) and depth = ceil(ln(1 / delta)),
+// estimate(w) never undercounts and exceeds the true count by at most epsilon * total() with probability 1 - delta.
+class CountMinSketch
+{
+public:
+    CountMinSketch(size_t width, size_t depth) : width(width), depth(depth), counters(width * depth, 0) {}
+
+    // conservative update: only counters below the new estimate are raised, which keeps the bound but tightens estimates
+    void add(std::string_view word, uint32_t count = 1)
+    {
+        const auto hash = std::hash<std::string_view>{}(word);
+        const auto target = estimateHash(hash) + count;
+        for (size_t row = 0; row < depth; ++row)
+        {
+            auto &counter = counters[row * width + column(hash, row)];
+            counter = std::max(counter, target);
+        }
+        n += count;
+    }
+
+    uint32_t estimate(std::string_view word) const { return estimateHash(std::hash<std::string_view>{}(word)); }
+
+    uint64_t total() const { return n; }
+
+    void reset()
+    {
+        std::fill(counters.begin(), counters.end(), 0);
+        n = 0;
+    }
+
+private:
+    size_t width;
+    size_t depth;
+    std::vector<uint32_t> counters;
+    uint64_t n = 0;
+
+    size_t column(uint64_t hash, size_t row) const { return mixHash(hash + row * 0x632BE59BD9B4E019ULL) % width; }
+
+    uint32_t estimateHash(uint64_t hash) const
+    {
+        uint32_t result = std::numeric_limits<uint32_t>::max();
+        for (size_t row = 0; row < depth; ++row)
+        {
+            result = std::min(result, counters[row * width + column(hash, row)]);
+        }
+        return result;
+    }
+};
+
+// HyperLogLog with 2^precision registers: relative standard error of the distinct count is about 1.04 / sqrt(2^precision)
+class HyperLogLog
+{
+public:
+    explicit HyperLogLog(uint8_t precision) : precision(precision), registers(size_t{1} << precision, 0) {}
 
-    FileHandler(const string &filename) : file(filename)
+    void add(std::string_view word)
     {
-        if (!file.is_open())
-        {
-            throw runtime_error("Error opening file: " + filename);
-        }
+        const auto hash = mixHash(std::hash<std::string_view>{}(word));
+        const auto index = hash >> (64 - precision);
+        const auto rest = hash << precision;
+        const auto rank = static_cast<uint8_t>(rest == 0 ? 64 - precision + 1 : __builtin_clzll(rest) + 1);
+        registers[index] = std::max(registers[index], rank);
     }
 
-    ~FileHandler()
+    double estimate() const
     {
-        if (file.is_open())
+        const auto m = static_cast<double>(registers.size());
+        double sum = 0.0;
+        size_t zeros = 0;
+        for (const auto r : registers)
         {
-            file.close();
+            sum += std::ldexp(1.0, -r);
+            zeros += r == 0;
         }
+        const auto raw = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+        // small-range correction: linear counting while registers are still empty
+        return (raw <= 2.5 * m && zeros != 0) ? m * std::log(m / zeros) : raw;
     }
 
-    auto readLines()
+    void reset() { std::fill(registers.begin(), registers.end(), 0); }
+
+private:
+    uint8_t precision;
+    std::vector<uint8_t> registers;
+};
+
+// Space-Saving top-k: with k counters every word occurring more than total / k times is reported,
+// and each reported count overestimates the true count by at most its error (<= total / k).
+// A word -> slot map finds the counter and an indexed min-heap over the slots finds the one to evict,
+// so every add is O(log k) instead of a scan over all k counters.
+class SpaceSaving
+{
+public:
+    struct Counter
     {
-        vector<string> lines;
-        string line;
-        while (getline(file, line))
-        {
-            lines.push_back(line);
-        }
-        return lines;
-    }
+        std::string word;
+        uint64_t count;
+        uint64_t error;
+    };
 
-    auto writeLines(const std::vector<std::string> &lines, const std::string &filename)
+    explicit SpaceSaving(size_t capacity) : capacity(capacity)
     {
-        std::ofstream file(filename);
+        // counters never reallocate, so the map keys can view their words
+        counters.reserve(capacity);
+        heap.reserve(capacity);
+        heapPosition.reserve(capacity);
+        slots.reserve(capacity);
+    }
 
-        if (!file)
+    void add(std::string_view word)
+    {
+        if (capacity == 0)
         {
-            throw std::runtime_error("Error opening output file: " + filename);
+            return;
         }
-
-        for (const auto &line : lines)
+        if (const auto it = slots.find(word); it != slots.end())
+        {
+            counters[it->second].count++;
+            siftDown(heapPosition[it->second]);
+        }
+        else if (counters.size() < capacity)
+        {
+            const auto slot = counters.size();
+            counters.push_back(Counter{std::string(word), 1, 0});
+            slots.emplace(counters.back().word, slot);
+            heap.push_back(slot);
+            heapPosition.push_back(heap.size() - 1);
+            siftUp(heap.size() - 1);
+        }
+        else
         {
-            file << "Chapter " << &line - &lines.front() + 1 << ": " << line << '\n';
+            // evict the minimum, the newcomer inherits its count as error
+            const auto slot = heap.front();
+            auto &minimum = counters[slot];
+            slots.erase(minimum.word);
+            minimum = Counter{std::string(word), minimum.count + 1, minimum.count};
+            slots.emplace(minimum.word, slot);
+            siftDown(0);
         }
+    }
 
-        std::cout << "Chapter categorizations saved to '" << filename << "'" << std::endl;
+    // returns counters ordered by estimated count, largest first
+    std::vector<Counter> top() const
+    {
+        auto result = counters;
+        std::sort(result.begin(), result.end(), [](const Counter &a, const Counter &b)
+                  { return a.count != b.count ? a.count > b.count : a.word < b.word; });
+        return result;
     }
 
 private:
-    ifstream file;
-};
+    size_t capacity;
+    std::vector<Counter> counters;
+    std::unordered_map<std::string_view, size_t> slots; // word -> index into counters
+    std::vector<size_t> heap;                           // counter indices, smallest count at the front
+    std::vector<size_t> heapPosition;                   // counter index -> position in heap
 
-/*
-2) Read files: Create a function that reads a file and returns its content as a vector of strings.
-   The function should be implemented using functional programming, immutability, and lambdas where possible.
-*/
-auto readFile = [](const string &filename) -> Result<std::vector<std::string>>
-{
-    try
-    {
-        FileHandler fileHandler(filename);
-        return fileHandler.readLines(); // returns vector of lines
-    }
-    catch (const std::exception &e)
+    uint64_t countAt(size_t position) const { return counters[heap[position]].count; }
+
+    void swapHeap(size_t a, size_t b)
     {
-        return "Error opening or reading file: " + filename + ". " + e.what();
+        std::swap(heap[a], heap[b]);
+        heapPosition[heap[a]] = a;
+        heapPosition[heap[b]] = b;
     }
-};
 
-auto writeLines = [](const std::vector<std::string> &lines, const std::string &filename) -> Result<Success>
-{
-    try
+    void siftUp(size_t position)
     {
-        FileHandler fileHandler;
-        fileHandler.writeLines(lines, filename);
-        return Success{};
+        while (position > 0 && countAt((position - 1) / 2) > countAt(position))
+        {
+            swapHeap(position, (position - 1) / 2);
+            position = (position - 1) / 2;
+        }
     }
-    catch (const std::exception &e)
+
+    void siftDown(size_t position)
     {
-        return "Error writing to file: " + filename + ". " + e.what();
+        while (true)
+        {
+            auto smallest = position;
+            for (const auto child : {2 * position + 1, 2 * position + 2})
+            {
+                if (child < heap.size() && countAt(child) < countAt(smallest))
+                {
+                    smallest = child;
+                }
+            }
+            if (smallest == position)
+            {
+                return;
+            }
+            swapHeap(position, smallest);
+            position = smallest;
+        }
     }
 };
 
-/*
-3) Tokenize the text: Create a function to tokenize a string into words.
-   This function should use functional programming techniques and lambdas for string manipulation and splitting.
-*/
-auto tokenize = [](const std::string &text)
+struct ApproxConfig
 {
-    return text | ranges::views::split_when([](char c)
-                                            {
-                                                return c == ' ' || c == '\r' || c == '\n' || c == '\t' ||
-                                                       c == ',' || c == ':' || c == ';' || c == '.' || c == '!' || c == '?' ||
-                                                       c == '\'' || c == '\"'; // not sure what delimiters we should use
-                                            }) |
-           ranges::views::transform([](auto &&rng)
-                                    { return std::string(&*rng.begin(), ranges::distance(rng)); });
-}; // returns view of strings
+    size_t sketchWidth = 2048; // epsilon = e / 2048 of the chapter length per term
+    size_t sketchDepth = 4;    // delta = e^-4
+    uint8_t hllPrecision = 10; // ~3.3% standard error
+    size_t topK = 64;
+};
 
-auto tokenizeAll = [](const std::vector<std::string> &lines)
+struct ApproxChapters
 {
-    std::vector<std::string> result;
-    result.reserve(lines.size());
+    std::vector<double> warDensities;
+    std::vector<double> peaceDensities;
+    std::vector<double> vocabularySizes; // estimated distinct words per chapter
+    std::vector<SpaceSaving::Counter> topWords;
+};
+
+// same chapter split as processChapters, but term hits are estimated from a per-chapter Count-Min sketch,
+// so memory stays fixed no matter how large the vocabulary grows
+auto processChaptersApprox = [](const std::vector<std::string> &tokenizedBook, const std::vector<std::string> &warTokens, const std::vector<std::string> &peaceTokens,
+                                const ApproxConfig &config = ApproxConfig{})
+{
+    const ScopedTimer timer("processChaptersApprox");
+    ApproxChapters result;
+    CountMinSketch sketch(config.sketchWidth, config.sketchDepth);
+    HyperLogLog distinct(config.hllPrecision);
+    SpaceSaving frequent(config.topK);
+    size_t wordsInChapter = 0;
+
+    auto estimatedHits = [&sketch](const std::vector<std::string> &terms)
+    {
+        return std::accumulate(terms.begin(), terms.end(), uint64_t{0}, [&sketch](uint64_t sum, const std::string &term)
+                               { return sum + sketch.estimate(term); });
+    };
+    auto closeChapter = [&]()
+    {
+        const auto density = [wordsInChapter](uint64_t hits)
+        { return wordsInChapter == 0 ? 0.0 : std::min(1.0, static_cast<double>(hits) / wordsInChapter); };
+        result.warDensities.push_back(density(estimatedHits(warTokens)));
+        result.peaceDensities.push_back(density(estimatedHits(peaceTokens)));
+        result.vocabularySizes.push_back(distinct.estimate());
+        sketch.reset();
+        distinct.reset();
+        wordsInChapter = 0;
+    };
+
+    for (const auto &word : tokenizedBook)
+    {
+        if (startsChapter(word == "CHAPTER" ? MARKER : NONE, wordsInChapter))
+        {
+            closeChapter();
+        }
+        sketch.add(word);
+        // empty tokens come from lines that start with a delimiter, they are not words
+        if (!word.empty())
+        {
+            distinct.add(word);
+            frequent.add(word);
+        }
+        ++wordsInChapter;
+    }
 
-    for (const auto &line : lines)
+    if (wordsInChapter != 0)
     {
-        auto words = tokenize(line) | to<std::vector<std::string>>;
-        // insert elements directly at end without reallocation
-        result.insert(result.end(), words.begin(), words.end());
+        closeChapter();
     }
 
+    result.topWords = frequent.top();
     return result;
-}; // returns vector of strings
+};
 
-/*
-4) Filter words: Create a function to filter words from a list based on another list.
-   This function should use functional programming techniques, such as higher-order functions and lambdas, to perform filtering.
-*/
-auto filterWords = [](const std::vector<std::string> &words, const std::vector<std::string> &filterList)
+auto categorizeChapters = [](const std::vector<double> &warDensities, const std::vector<double> &peaceDensities, ExecMode exec = ExecMode::Seq)
 {
-    std::vector<std::string> result;
-    std::copy_if(words.begin(), words.end(), std::back_inserter(result), [&filterList](const std::string &word)
-                 { return std::find(filterList.begin(), filterList.end(), word) != filterList.end(); });
-    return result; // returns vector containing filtered words
+    const ScopedTimer timer("categorizeChapters");
+    std::vector<std::string> chapterCategorizations(warDensities.size());
+
+    // both labels fit the small-string buffer, so assigning them never allocates
+    withPolicy(exec, [&](auto policy)
+               { std::transform(policy, warDensities.begin(), warDensities.end(), peaceDensities.begin(), chapterCategorizations.begin(),
+                                [](double warDensity, double peaceDensity)
+                                {
+                                    return (warDensity > peaceDensity) ? "war-related" : "peace-related";
+                                }); });
+
+    return chapterCategorizations;
 };
 
-/*
-5) Count occurrences: Create a function to count the occurrences of words in a list.
-   This function should use the map-reduce philosophy and functional programming techniques
-   to count word occurrences in a parallelizable and efficient manner.
-*/
-auto countOccurrences = [](const std::vector<std::string> &words)
+// splitmix64 stream; generated corpora seed one stream per chapter, so chapters can be produced in any order
+struct SplitMix
 {
-    std::unordered_map<std::string, int> count;
-    for (const auto &word : words)
-    {
-        count[word]++;
-    }
-    /*
-    for (const auto &elem : count)
+    uint64_t state;
+
+    uint64_t next() { return mixHash(state += 0x9E3779B97F4A7C15ULL); }
+    double uniform() { return (next() >> 11) * 0x1.0p-53; } // [0, 1)
+
+    double normal() // Box-Muller
     {
-        std::cout << elem.first << " " << elem.second << " | ";
+        const auto radius = std::sqrt(-2.0 * std::log(1.0 - uniform()));
+        return radius * std::cos(6.283185307179586 * uniform());
     }
-    std::cout << "| " << endl;*/
-    return count; // returns map: key=word, value=counts of the word
 };
 
-/*
-6) Calculate term density: Create a function to calculate the density of terms in a text,
-   based on the occurrences of words and their relative distances to the next word of the same category.
-   This function should use functional programming techniques and the map-reduce philosophy for parallelization and efficiency.
-*/
-auto calculateDensity = [](const std::vector<std::string> &words, const std::unordered_map<std::string, int> &occurrences) // bisher 66,85% Übereinstimmung mit Moodle Lösung lol
+// Vose's alias table: draws rank r with probability proportional to 1 / (r + 1)^exponent in constant time
+class ZipfSampler
 {
-    if (words.empty())
+public:
+    ZipfSampler(size_t ranks, double exponent) : probability(ranks, 1.0), alias(ranks)
     {
-        return 0.0;
-    }
+        std::vector<double> weights(ranks);
+        for (size_t rank = 0; rank < ranks; ++rank)
+        {
+            weights[rank] = std::pow(rank + 1.0, -exponent);
+        }
+        const auto scale = ranks / std::accumulate(weights.begin(), weights.end(), 0.0);
 
-    int total_occurrences = 0;
+        std::vector<size_t> small, large;
+        for (size_t rank = 0; rank < ranks; ++rank)
+        {
+            weights[rank] *= scale;
+            (weights[rank] < 1.0 ? small : large).push_back(rank);
+        }
+        while (!small.empty() && !large.empty())
+        {
+            const auto less = small.back();
+            const auto more = large.back();
+            small.pop_back();
+            probability[less] = weights[less];
+            alias[less] = more;
+            weights[more] -= 1.0 - weights[less];
+            if (weights[more] < 1.0)
+            {
+                large.pop_back();
+                small.push_back(more);
+            }
+        }
+        for (size_t rank = 0; rank < ranks; ++rank)
+        {
+            alias[rank] = probability[rank] < 1.0 ? alias[rank] : rank; // leftovers of either list only differ from 1 by rounding
+        }
+    }
 
-    for (const auto &term : occurrences)
+    size_t operator()(SplitMix &random) const
     {
-        total_occurrences += term.second;
+        const auto column = static_cast<size_t>((random.next() >> 32) * probability.size() >> 32);
+        return random.uniform() < probability[column] ? column : alias[column];
     }
 
-    return static_cast<double>(total_occurrences) / words.size();
+private:
+    std::vector<double> probability;
+    std::vector<size_t> alias;
 };
 
-auto processChapter = [](const std::vector<std::string> &chapterWords, const std::vector<std::string> &warTokens, const std::vector<std::string> &peaceTokens,
-                         std::vector<double> &warDensities, std::vector<double> &peaceDensities)
+struct CorpusConfig
+{
+    uint64_t seed = 1;
+    size_t vocabulary = 20000;   // distinct filler words
+    double zipf = 1.0;           // exponent of the filler word-rank distribution
+    double termRate = 0.01;      // share of words drawn uniformly from the term lists
+    double chapterWords = 1600;  // mean chapter length in words (War and Peace: about 1600)
+    double chapterSpread = 0.5;  // sigma of the log-normal chapter length, 0 = every chapter has the mean length
+    size_t chaptersPerBook = 20; // a "BOOK n" heading opens every this many chapters, 0 = none
+    size_t paragraphWords = 60;  // mean paragraph length in words
+};
+
+// lowercase pseudo-words that grow longer with their rank, like real frequent and rare words; none is excluded
+auto syntheticVocabulary = [](size_t size, uint64_t seed, const std::vector<std::string> &excluded)
 {
-    auto warDensity = calculateDensity(chapterWords, countOccurrences(filterWords(chapterWords, warTokens)));
-    auto peaceDensity = calculateDensity(chapterWords, countOccurrences(filterWords(chapterWords, peaceTokens)));
+    const std::string consonants = "bcdfghjklmnprstvwz";
+    const std::string vowels = "aeiou";
+    std::unordered_map<std::string, bool> taken;
+    for (const auto &word : excluded)
+    {
+        taken[word] = true;
+    }
 
-    warDensities.push_back(warDensity);
-    peaceDensities.push_back(peaceDensity);
+    SplitMix random{seed};
+    std::vector<std::string> words;
+    words.reserve(size);
+    while (words.size() < size)
+    {
+        const auto length = 1 + static_cast<size_t>(std::log2(words.size() + 2.0) / 2) + random.next() % 4;
+        std::string word;
+        for (size_t i = 0; i < length; ++i)
+        {
+            word += i % 2 == 0 ? consonants[random.next() % consonants.size()] : vowels[random.next() % vowels.size()];
+        }
+        if (taken.emplace(word, true).second)
+        {
+            words.push_back(std::move(word));
+        }
+    }
+    return words;
 };
 
-auto processChapters = [](const std::vector<std::string> &tokenizedBook, const std::vector<std::string> &warTokens, const std::vector<std::string> &peaceTokens)
+// the size most frequent tokens of a real text, most frequent first; excluded words, empty tokens and anything
+// that would turn a line into a BOOK, EPILOGUE or CHAPTER heading are left out
+auto rankedVocabulary = [](const std::vector<std::string> &tokens, size_t size, const std::vector<std::string> &excluded)
 {
-    std::vector<double> warDensities;
-    std::vector<double> peaceDensities;
+    const auto interned = internTokens(tokens);
+    const auto counts = countIdOccurrences(interned.ids, interned.vocabulary.size());
+    std::vector<uint32_t> ranked(counts.size());
+    std::iota(ranked.begin(), ranked.end(), uint32_t{0});
+    ranked.erase(std::remove_if(ranked.begin(), ranked.end(), [&interned, &excluded](uint32_t id)
+                                {
+                                    const auto word = interned.vocabulary.word(id);
+                                    return word.empty() || std::find(excluded.begin(), excluded.end(), word) != excluded.end() ||
+                                           word.find("CHAPTER") != std::string_view::npos || word.find("BOOK") != std::string_view::npos ||
+                                           word.find("EPILOGUE") != std::string_view::npos; }),
+                 ranked.end());
+    std::sort(ranked.begin(), ranked.end(), [&interned, &counts](uint32_t a, uint32_t b)
+              { return counts[a] != counts[b] ? counts[a] > counts[b] : interned.vocabulary.word(a) < interned.vocabulary.word(b); });
+    ranked.resize(std::min(size, ranked.size()));
 
-    std::vector<std::string> currentChapterWords;
+    std::vector<std::string> words(ranked.size());
+    std::transform(ranked.begin(), ranked.end(), words.begin(), [&interned](uint32_t id)
+                   { return std::string(interned.vocabulary.word(id)); });
+    return words;
+};
 
-    for (const auto &word : tokenizedBook)
+// text in the layout of the book (CRLF lines of about 72 characters, blank-line paragraphs, BOOK and CHAPTER headings);
+// every chapter is a pure function of its index and the seed
+class CorpusGenerator
+{
+public:
+    CorpusGenerator(CorpusConfig config, std::vector<std::string> vocabulary, std::vector<std::string> terms)
+        : config(config), vocabulary(std::move(vocabulary)), terms(std::move(terms)), zipf(this->vocabulary.size(), config.zipf)
     {
-        if (word == "CHAPTER" && currentChapterWords.size() != 1) // including && currentChapterWords.size() != 0 would make sense but i get more percent without lol
+        if (this->vocabulary.empty())
         {
-            // currentChapterWords.push_back(word);
-            processChapter(currentChapterWords, warTokens, peaceTokens, warDensities, peaceDensities);
-            currentChapterWords.clear();
+            throw std::invalid_argument("corpus vocabulary is empty");
         }
-        currentChapterWords.push_back(word);
     }
 
-    // process the last chapter if there are remaining words
-    if (!currentChapterWords.empty())
+    std::string chapter(size_t index) const
     {
-        processChapter(currentChapterWords, warTokens, peaceTokens, warDensities, peaceDensities);
+        SplitMix random{mixHash(config.seed) ^ (index * 0xD1B54A32D192ED03ULL)};
+        std::string text;
+        if (config.chaptersPerBook != 0 && index % config.chaptersPerBook == 0)
+        {
+            text += "BOOK " + std::to_string(index / config.chaptersPerBook + 1) + "\r\n\r\n\r\n";
+        }
+        text += "CHAPTER " + std::to_string(index + 1) + "\r\n\r\n";
+
+        const auto mu = std::log(config.chapterWords) - config.chapterSpread * config.chapterSpread / 2; // keeps the mean at chapterWords
+        const auto words = std::max<long long>(1, std::llround(std::exp(mu + config.chapterSpread * random.normal())));
+        auto lineStart = text.size();
+        for (long long word = 0; word < words; ++word)
+        {
+            const auto isTerm = !terms.empty() && random.uniform() < config.termRate;
+            text += isTerm ? terms[random.next() % terms.size()] : vocabulary[zipf(random)];
+
+            const auto punctuation = random.uniform();
+            if (word + 1 == words || punctuation < 1.0 / std::max<size_t>(1, config.paragraphWords))
+            {
+                text += ".\r\n\r\n";
+                lineStart = text.size();
+                continue;
+            }
+            text += punctuation < 0.07 ? ". " : (punctuation < 0.15 ? ", " : " ");
+            if (text.size() - lineStart > 72)
+            {
+                text.back() = '\r';
+                text += '\n';
+                lineStart = text.size();
+            }
+        }
+        text += "\r\n";
+        return text;
     }
 
-    return std::make_pair(warDensities, peaceDensities);
+private:
+    CorpusConfig config;
+    std::vector<std::string> vocabulary;
+    std::vector<std::string> terms;
+    ZipfSampler zipf;
 };
 
-auto categorizeChapters = [](const std::vector<double> &warDensities, const std::vector<double> &peaceDensities)
+struct CorpusStats
 {
-    std::vector<std::string> chapterCategorizations(warDensities.size());
+    uint64_t bytes = 0;
+    size_t chapters = 0;
+};
 
-    std::transform(warDensities.begin(), warDensities.end(), peaceDensities.begin(), chapterCategorizations.begin(),
-                   [](double warDensity, double peaceDensity)
-                   {
-                       return (warDensity > peaceDensity) ? "war-related" : "peace-related";
-                   });
+// writes chapters until the corpus has the requested size; the last one is cut after its last line that fits.
+// Chapters are generated batchChapters at a time in parallel and written in order, so the output does not depend on it.
+auto generateCorpus = [](const CorpusGenerator &generator, uint64_t bytes, std::ostream &out, size_t batchChapters = 64) -> Result<CorpusStats>
+{
+    const ScopedTimer timer("generateCorpus");
+    CorpusStats stats;
+    std::vector<std::string> batch(std::max<size_t>(1, batchChapters));
+    while (stats.bytes < bytes)
+    {
+        const auto first = stats.chapters;
+        tbb::parallel_for(size_t{0}, batch.size(), [&](size_t i)
+                          { batch[i] = generator.chapter(first + i); });
 
-    return chapterCategorizations;
+        for (auto &text : batch)
+        {
+            const auto remaining = bytes - stats.bytes;
+            if (text.size() > remaining)
+            {
+                const auto lastLine = text.rfind('\n', remaining - 1);
+                text.resize(lastLine == std::string::npos ? 0 : lastLine + 1);
+                bytes = stats.bytes + text.size(); // nothing after the cut
+            }
+            out.write(text.data(), static_cast<std::streamsize>(text.size()));
+            stats.bytes += text.size();
+            stats.chapters += !text.empty();
+            if (stats.bytes == bytes)
+            {
+                break;
+            }
+        }
+        if (!out)
+        {
+            return std::string("Error writing the generated corpus");
+        }
+    }
+    return stats;
+};
+
+struct Options
+{
+    MatchMode matchMode = MatchMode::Exact;
+    bool approximate = false; // fixed-memory sketches instead of exact counts
+    DensityMode densityMode = DensityMode::Ratio;
+    size_t window = 0; // sliding-window profile size in tokens, 0 = off
+    size_t stride = 0; // defaults to a quarter of the window
+    bool incremental = false; // rescore from the persisted scoring state when only the term lists changed
+    bool append = false;      // only score what was appended to the book since the last run
+    size_t chunkBytes = 0;    // score byte chunks of this size in parallel, 0 = line-based pipeline
+    ExecMode execMode = ExecMode::Par; // policy of tokenize, classify, count and categorize
+    size_t pipelineChunks = 0;         // chunks in flight of the pipelined engine, 0 = off
+    size_t sectionPart = 0;            // also score this part (1-based, from the structure index), 0 = off
+    size_t sectionChapter = 0;         // chapter within sectionPart, 0 = the whole part
+    bool rollup = false;               // also write book, volume and corpus statistics
+    std::optional<Schedule> schedule;  // size-aware chapter scheduling with load metrics instead of the policy-driven scorer
+    bool paragraphs = false;           // categorize every paragraph instead of every chapter
+    EngineConfig engine;               // worker pool size and CPU pinning
+    std::string profileFile;           // write per-stage wall and CPU times as JSON here, empty = off
+    bool trackAllocations = false;     // also count allocations per stage for the profile
+    std::string bookFile = "files/war_and_peace.txt";
+};
+
+auto parseOptions = [](const std::vector<std::string> &args) -> Result<Options>
+{
+    Options options;
+    for (const auto &arg : args)
+    {
+        if (arg == "--stem")
+        {
+            options.matchMode = MatchMode::Stem;
+        }
+        else if (arg == "--density=ratio" || arg == "--density=distance")
+        {
+            options.densityMode = arg == "--density=distance" ? DensityMode::Distance : DensityMode::Ratio;
+        }
+        else if (arg == "--exec=seq" || arg == "--exec=par" || arg == "--exec=par_unseq")
+        {
+            options.execMode = arg == "--exec=seq" ? ExecMode::Seq : (arg == "--exec=par" ? ExecMode::Par : ExecMode::ParUnseq);
+        }
+        else if (arg == "--approx")
+        {
+            options.approximate = true;
+        }
+        else if (arg == "--append")
+        {
+            options.append = true;
+        }
+        else if (arg == "--incremental")
+        {
+            options.incremental = true;
+        }
+        else if (arg == "--schedule=even" || arg == "--schedule=longest")
+        {
+            options.schedule = arg == "--schedule=even" ? Schedule::Even : Schedule::LongestFirst;
+        }
+        else if (arg == "--paragraphs")
+        {
+            options.paragraphs = true;
+        }
+        else if (arg == "--track-allocations")
+        {
+            options.trackAllocations = true;
+        }
+        else if (arg == "--rollup")
+        {
+            options.rollup = true;
+        }
+        else if (arg.rfind("--section=", 0) == 0)
+        {
+            // --section=P or --section=P.C
+            const auto value = arg.substr(std::string("--section=").size());
+            const auto dot = value.find('.');
+            const auto part = value.substr(0, dot);
+            const auto chapter = dot == std::string::npos ? std::string("0") : value.substr(dot + 1);
+            if (part.empty() || chapter.empty() || (part + chapter).find_first_not_of("0123456789") != std::string::npos || std::stoull(part) == 0)
+            {
+                return "Invalid section in option: " + arg;
+            }
+            options.sectionPart = std::stoull(part);
+            options.sectionChapter = std::stoull(chapter);
+        }
+        else if (arg.rfind("--profile=", 0) == 0 || arg.rfind("--book=", 0) == 0)
+        {
+            const auto file = arg.substr(arg.find('=') + 1);
+            if (file.empty())
+            {
+                return "Missing file name in option: " + arg;
+            }
+            (arg[2] == 'p' ? options.profileFile : options.bookFile) = file;
+        }
+        else if (arg.rfind("--affinity=", 0) == 0)
+        {
+            // --affinity=0,2,4
+            const auto value = arg.substr(std::string("--affinity=").size()) + ",";
+            for (size_t begin = 0, comma = value.find(','); comma != std::string::npos; begin = comma + 1, comma = value.find(',', begin))
+            {
+                const auto cpu = value.substr(begin, comma - begin);
+                if (cpu.empty() || cpu.size() > 4 || cpu.find_first_not_of("0123456789") != std::string::npos)
+                {
+                    return "Invalid CPU list in option: " + arg;
+                }
+                options.engine.cpus.push_back(std::stoi(cpu));
+            }
+        }
+        else if (arg.rfind("--window=", 0) == 0 || arg.rfind("--stride=", 0) == 0 || arg.rfind("--chunk-bytes=", 0) == 0 || arg.rfind("--pipeline=", 0) == 0 ||
+                 arg.rfind("--threads=", 0) == 0)
+        {
+            const auto name = arg.substr(0, arg.find('=') + 1);
+            const auto value = arg.substr(name.size());
+            if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+            {
+                return "Invalid number in option: " + arg;
+            }
+            const std::vector<std::pair<std::string, size_t *>> numbers = {
+                {"--window=", &options.window}, {"--stride=", &options.stride}, {"--chunk-bytes=", &options.chunkBytes}, {"--pipeline=", &options.pipelineChunks},
+                {"--threads=", &options.engine.threads}};
+            *std::find_if(numbers.begin(), numbers.end(), [&name](const auto &number)
+                          { return number.first == name; })
+                 ->second = std::stoull(value);
+        }
+        else
+        {
+            return "Unknown option: " + arg;
+        }
+    }
+    if (options.incremental && (options.approximate || options.window != 0 || options.densityMode != DensityMode::Ratio))
+    {
+        return std::string("--incremental cannot be combined with --approx, --window or --density=distance");
+    }
+    if (options.append && (options.incremental || options.approximate || options.window != 0))
+    {
+        return std::string("--append cannot be combined with --incremental, --approx or --window");
+    }
+    if ((options.chunkBytes != 0 || options.pipelineChunks != 0) && (options.append || options.incremental || options.approximate || options.window != 0))
+    {
+        return std::string("--chunk-bytes and --pipeline cannot be combined with --append, --incremental, --approx or --window");
+    }
+    if (options.schedule && (options.append || options.approximate || options.chunkBytes != 0 || options.pipelineChunks != 0))
+    {
+        return std::string("--schedule only applies to the token-based scorer, not to --append, --approx, --chunk-bytes or --pipeline");
+    }
+    if (options.paragraphs && (options.append || options.incremental || options.approximate || options.window != 0 || options.chunkBytes != 0 ||
+                               options.pipelineChunks != 0 || options.schedule || options.rollup || options.sectionPart != 0))
+    {
+        return std::string("--paragraphs only combines with --stem, --density and --exec");
+    }
+    if (options.rollup && (options.incremental || options.approximate))
+    {
+        return std::string("--rollup needs per-chapter counts, which --incremental and --approx do not keep");
+    }
+    if (options.trackAllocations && options.profileFile.empty())
+    {
+        return std::string("--track-allocations reports into the profile and needs --profile=FILE");
+    }
+    if (options.trackAllocations && !AllocationTracker::available)
+    {
+        return std::string("--track-allocations needs a build with -DFPROG_TRACK_ALLOCATIONS");
+    }
+    if (options.stride == 0)
+    {
+        options.stride = std::max<size_t>(1, options.window / 4);
+    }
+    return options;
 };
 
 #ifndef TESTING
-int main()
+int main(int argc, char *argv[])
 {
     auto startTime = std::chrono::high_resolution_clock::now();
+    const auto startCpu = std::clock();
     try
     {
+        const auto parsedOptions = parseOptions(std::vector<std::string>(argv + 1, argv + argc));
+        if (auto err = std::get_if<std::string>(&parsedOptions))
+        {
+            throw std::runtime_error(*err);
+        }
+        const auto options = std::get<Options>(parsedOptions);
+        Profiler::global().enable(!options.profileFile.empty());
+        AllocationTracker::enable(options.trackAllocations);
+
         /*
         7) Read input files and tokenize: Read the input files (book, war terms, and peace terms)
            and tokenize their contents into words using the functions created in steps 2 and 3.
         */
-        auto book = readFile("files/war_and_peace.txt");
+        const auto &bookFile = options.bookFile;
+        const std::string stateFile = "files/output/scoringState.bin";
         auto warTerms = readFile("files/war_terms.txt");
         auto peaceTerms = readFile("files/peace_terms.txt");
 
-        if (auto err = std::get_if<std::string>(&book))
-        {
-            throw std::runtime_error(*err);
-        }
-        else if (auto err = std::get_if<std::string>(&warTerms))
+        if (auto err = std::get_if<std::string>(&warTerms))
         {
             throw std::runtime_error(*err);
         }
@@ -273,27 +3621,237 @@ int main()
 
         const auto warTokens = tokenizeAll(std::get<std::vector<std::string>>(warTerms));
         const auto peaceTokens = tokenizeAll(std::get<std::vector<std::string>>(peaceTerms));
-        const auto bookTokens = tokenizeAll(std::get<std::vector<std::string>>(book));
+
+        // incremental run: the book is unchanged since the state was saved, only the term lists are re-applied
+        auto savedState = options.incremental ? readScoringState(stateFile) : Result<ScoringState>(std::string("not requested"));
+        const auto currentBook = fileFingerprint(bookFile);
+        const auto stateIsCurrent = std::holds_alternative<ScoringState>(savedState) && std::holds_alternative<FileFingerprint>(currentBook) &&
+                                    std::get<ScoringState>(savedState).book == std::get<FileFingerprint>(currentBook) &&
+                                    std::get<ScoringState>(savedState).matchMode == options.matchMode;
 
         /*
         8) Process chapters: Process each chapter in the book by calculating the density of war and peace terms
            using the functions created in steps 4, 5, and 6. Store the densities in separate vectors for further processing.
         */
-        const auto densities = processChapters(bookTokens, warTokens, peaceTokens);
+        auto densities = std::make_pair(std::vector<double>{}, std::vector<double>{});
+        std::vector<ChapterCounts> chapterCounts; // kept for the rollups, empty on the --incremental and --approx paths
+
+        // one worker pool for every stage of the run; the threads start here once
+        Engine engine(options.engine);
+        auto scoreBook = [&]
+        {
+            const ScopedTimer timer("scoreBook");
+            if (options.paragraphs)
+            {
+                const auto bytes = readWholeFile(bookFile);
+                if (auto err = std::get_if<std::string>(&bytes))
+                {
+                    throw std::runtime_error(*err);
+                }
+                const auto &book = std::get<std::vector<char>>(bytes);
+                densities = chapterDensities(scoreParagraphs(std::string_view(book.data(), book.size()), TermClassifier(warTokens, peaceTokens, options.matchMode)),
+                                             options.densityMode);
+            }
+            else if (options.append)
+            {
+                const std::string appendStateFile = "files/output/appendState.bin";
+                auto previous = readAppendState(appendStateFile);
+                auto scored = appendScore(std::holds_alternative<AppendState>(previous) ? std::move(std::get<AppendState>(previous)) : AppendState{},
+                                          bookFile, warTokens, peaceTokens, options.matchMode, options.densityMode);
+                if (auto err = std::get_if<std::string>(&scored))
+                {
+                    throw std::runtime_error(*err);
+                }
+                auto &[state, chapters] = std::get<std::pair<AppendState, std::vector<ChapterCounts>>>(scored);
+                chapterCounts = std::move(chapters);
+                densities = chapterDensities(chapterCounts, options.densityMode);
+
+                auto stateResult = writeAppendState(state, appendStateFile);
+                if (auto err = std::get_if<std::string>(&stateResult))
+                {
+                    throw std::runtime_error(*err);
+                }
+                std::cout << "Book consumed up to byte " << state.offset << ", state saved to '" << appendStateFile << "'" << std::endl;
+            }
+            else if (options.pipelineChunks != 0)
+            {
+                const TermClassifier classifier(warTokens, peaceTokens, options.matchMode);
+                const auto chapters = scorePipelined(bookFile, classifier, options.chunkBytes != 0 ? options.chunkBytes : 1 << 20, options.pipelineChunks);
+                if (auto err = std::get_if<std::string>(&chapters))
+                {
+                    throw std::runtime_error(*err);
+                }
+                chapterCounts = std::get<std::vector<ChapterCounts>>(chapters);
+                densities = chapterDensities(chapterCounts, options.densityMode);
+            }
+            else if (options.chunkBytes != 0)
+            {
+                const auto bytes = readWholeFile(bookFile);
+                if (auto err = std::get_if<std::string>(&bytes))
+                {
+                    throw std::runtime_error(*err);
+                }
+                const auto &book = std::get<std::vector<char>>(bytes);
+                const TermClassifier classifier(warTokens, peaceTokens, options.matchMode);
+                chapterCounts = scoreChunked(std::string_view(book.data(), book.size()), classifier, options.chunkBytes);
+                densities = chapterDensities(chapterCounts, options.densityMode);
+            }
+            else if (stateIsCurrent)
+            {
+                const auto state = rescoreState(std::move(std::get<ScoringState>(savedState)), warTokens, peaceTokens);
+                densities = stateDensities(state);
+
+                auto stateResult = writeScoringState(state, stateFile);
+                if (auto err = std::get_if<std::string>(&stateResult))
+                {
+                    throw std::runtime_error(*err);
+                }
+                std::cout << "Rescored " << state.chapters.size() << " chapters incrementally from '" << stateFile << "'" << std::endl;
+            }
+            else
+            {
+                auto book = readFile(bookFile);
+                if (auto err = std::get_if<std::string>(&book))
+                {
+                    throw std::runtime_error(*err);
+                }
+                const auto bookTokens = tokenizeAll(std::get<std::vector<std::string>>(book), options.execMode);
+
+                if (options.approximate)
+                {
+                    auto approx = processChaptersApprox(bookTokens, warTokens, peaceTokens);
+                    densities = std::make_pair(std::move(approx.warDensities), std::move(approx.peaceDensities));
+
+                    std::cout << "Most frequent words (approximate):";
+                    std::for_each(approx.topWords.begin(), approx.topWords.begin() + std::min<size_t>(10, approx.topWords.size()), [](const auto &counter)
+                                  { std::cout << " " << counter.word << "=" << counter.count; });
+                    std::cout << std::endl;
+                    if (!approx.vocabularySizes.empty())
+                    {
+                        const auto total = std::accumulate(approx.vocabularySizes.begin(), approx.vocabularySizes.end(), 0.0);
+                        std::cout << "Distinct words per chapter (approximate): mean " << std::lround(total / approx.vocabularySizes.size()) << ", max "
+                                  << std::lround(*std::max_element(approx.vocabularySizes.begin(), approx.vocabularySizes.end())) << std::endl;
+                    }
+                }
+                else
+                {
+                    // classify each distinct word once, then every token is a single table lookup
+                    auto interned = internTokens(bookTokens);
+                    auto categories = classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, options.matchMode, options.execMode);
+                    if (options.schedule)
+                    {
+                        auto scheduled = scoreChaptersScheduled(interned.ids, categories, chapterIndex(interned.ids, categories), *options.schedule);
+                        chapterCounts = std::move(scheduled.chapters);
+                        std::cout << "Load imbalance (max / mean worker busy time): " << scheduled.imbalance() << " over " << scheduled.busyMilliseconds.size()
+                                  << " workers" << std::endl;
+                    }
+                    else
+                    {
+                        chapterCounts = scoreChapterIndex(interned.ids, categories, chapterIndex(interned.ids, categories), options.execMode);
+                    }
+                    densities = chapterDensities(chapterCounts, options.densityMode);
+
+                    if (options.window != 0)
+                    {
+                        const auto series = slidingWindowDensity(interned.ids, categories, options.window, options.stride);
+                        auto seriesResult = writeDensitySeries(series, "files/output/densitySeries.bin");
+                        if (auto err = std::get_if<std::string>(&seriesResult))
+                        {
+                            throw std::runtime_error(*err);
+                        }
+                        std::cout << "Density series (" << series.war.size() << " windows) saved to 'files/output/densitySeries.bin'" << std::endl;
+                    }
+
+                    if (options.incremental)
+                    {
+                        if (auto err = std::get_if<std::string>(&currentBook))
+                        {
+                            throw std::runtime_error(*err);
+                        }
+                        const auto state = buildScoringState(std::move(interned), std::move(categories), options.matchMode, std::get<FileFingerprint>(currentBook));
+                        auto stateResult = writeScoringState(state, stateFile);
+                        if (auto err = std::get_if<std::string>(&stateResult))
+                        {
+                            throw std::runtime_error(*err);
+                        }
+                        std::cout << "Scoring state saved to '" << stateFile << "'" << std::endl;
+                    }
+                }
+            }
+        };
+        engine.run(scoreBook);
 
         /*9) Categorize chapters: Iterate through the chapters, and for each chapter, compare the war density
            to the peace density to determine if it's war-related or peace-related. Store the results in a vector.
         */
-        const auto chapterCategorizations = categorizeChapters(densities.first, densities.second);
+        const auto chapterCategorizations = engine.run([&]
+                                                       { return categorizeChapters(densities.first, densities.second, options.execMode); });
 
         /*
         10) Print results: Iterate through the results vector and print each chapter's categorization as war-related or peace-related.
         */
-        auto writeResult = writeLines(chapterCategorizations, "files/output/chapterCategorizations.txt");
+        auto writeResult = engine.run([&]
+                                      { return options.paragraphs ? writeLines(chapterCategorizations, "files/output/paragraphCategorizations.txt", "Paragraph")
+                                                                  : writeLines(chapterCategorizations, "files/output/chapterCategorizations.txt"); });
         if (auto err = std::get_if<std::string>(&writeResult))
         {
             throw std::runtime_error(*err);
         }
+
+        // the structure index serves both the rollups and jumps to one book, epilogue or chapter
+        if (options.sectionPart != 0 || options.rollup)
+        {
+            const auto bytes = readWholeFile(bookFile);
+            if (auto err = std::get_if<std::string>(&bytes))
+            {
+                throw std::runtime_error(*err);
+            }
+            const std::string_view text(std::get<std::vector<char>>(bytes).data(), std::get<std::vector<char>>(bytes).size());
+            const auto structure = buildStructureIndex(text);
+
+            if (options.rollup)
+            {
+                const auto rollups = rollupChapters(chapterCounts, structure);
+                if (auto err = std::get_if<std::string>(&rollups))
+                {
+                    throw std::runtime_error(*err);
+                }
+                auto rollupResult = writeRollups(std::get<std::vector<Rollup>>(rollups), options.densityMode, "files/output/rollups.txt");
+                if (auto err = std::get_if<std::string>(&rollupResult))
+                {
+                    throw std::runtime_error(*err);
+                }
+                std::cout << "Book, volume and corpus rollups saved to 'files/output/rollups.txt'" << std::endl;
+            }
+
+            // tokenizes only the bytes of the requested section
+            if (options.sectionPart != 0)
+            {
+                const auto *section = structure.find(options.sectionPart, options.sectionChapter);
+                if (section == nullptr)
+                {
+                    throw std::runtime_error("No section " + std::to_string(options.sectionPart) + "." + std::to_string(options.sectionChapter) + " in the book (" +
+                                             std::to_string(structure.parts.size()) + " parts)");
+                }
+                const auto counts = scoreSection(text, *section, TermClassifier(warTokens, peaceTokens, options.matchMode));
+                const auto &part = structure.parts[options.sectionPart - 1];
+                std::cout << (part.title.empty() ? "(untitled part)" : part.title) << (section == &part ? "" : " / " + section->title) << ": "
+                          << counts.words << " words, war density " << counts.warDensity(options.densityMode) << ", peace density "
+                          << counts.peaceDensity(options.densityMode) << std::endl;
+            }
+        }
+
+        if (!options.profileFile.empty())
+        {
+            const auto wallMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+            auto profileResult = writeProfile(Profiler::global().totals(), wallMilliseconds, 1000.0 * (std::clock() - startCpu) / CLOCKS_PER_SEC, options.profileFile,
+                                              options.trackAllocations ? std::optional<AllocationCounts>(AllocationTracker::counts()) : std::nullopt);
+            if (auto err = std::get_if<std::string>(&profileResult))
+            {
+                throw std::runtime_error(*err);
+            }
+            std::cout << "Stage timings saved to '" << options.profileFile << "'" << std::endl;
+        }
     }
     catch (const std::exception &e)
     {
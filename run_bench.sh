@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# Create the output folder
+mkdir -p out
+
+# Compile the benchmarks
+clang++ -std=c++17 -Wall -Wextra -Werror -lstdc++ -lm -Iinclude/ bench.cpp -O3 -ltbb -o out/bench
+
+# Run the benchmarks
+./out/bench "$@"
@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# Create the output folder
+mkdir -p out
+
+# Compile the corpus generator
+clang++ -std=c++17 -Wall -Wextra -Werror -lstdc++ -lm -Iinclude/ generate.cpp -O3 -ltbb -o out/generate
+
+# Generate the corpus
+./out/generate "$@"
@@ -4,7 +4,7 @@
 mkdir -p out
 
 # Compile the tests
-clang++ -std=c++17 -Wall -Wextra -Werror -lstdc++ -lm -Iinclude/ tests.cpp -o out/tests
+clang++ -std=c++17 -Wall -Wextra -Werror -lstdc++ -lm -Iinclude/ tests.cpp -ltbb -o out/tests
 
 # Run the tests
 ./out/tests
\ No newline at end of file
@@ -4,6 +4,12 @@
 #define TESTING
 #include "project.cpp"
 
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <tbb/global_control.h>
+
 auto compareFiles = [](const std::string &file1, const std::string &file2)
 {
     std::ifstream fileStream1(file1);
@@ -161,6 +167,24 @@ TEST_CASE("tokenizeAll - Lines with different delimiters")
     CHECK(result == expected);
 }
 
+TEST_CASE("forEachToken - Same tokens as tokenizeAll over lines")
+{
+    const std::string text = "CHAPTER 1\r\n\r\n\"Well, Prince\r\n  indented line\n\nlast";
+    std::vector<std::string> lines;
+    std::istringstream stream(text);
+    for (std::string line; std::getline(stream, line);)
+    {
+        lines.push_back(line);
+    }
+
+    std::vector<std::string> tokens;
+    forEachToken(text, [&tokens](std::string_view token)
+                 { tokens.emplace_back(token); });
+
+    CHECK(tokens == tokenizeAll(lines));
+    CHECK(tokens == std::vector<std::string>{"CHAPTER", "1", "", "", "Well", "Prince", "", "indented", "line", "last"});
+}
+
 TEST_CASE("filterWords - Some matches")
 {
     const std::vector<std::string> words = {"apple", "banana", "orange", "grape"};
@@ -208,6 +232,61 @@ TEST_CASE("filterWords - All matches")
 
     CHECK(result == expected);
 }
+
+TEST_CASE("countOccurrences - Parallel partitions match sequential count")
+{
+    std::vector<std::string> words;
+    for (int i = 0; i < 20000; ++i)
+    {
+        words.push_back("word" + std::to_string(i % 37));
+    }
+
+    std::unordered_map<std::string, int> expected;
+    for (const auto &word : words)
+    {
+        expected[word]++;
+    }
+
+    const auto result = countOccurrences(words, 64);
+    const auto defaultGrain = countOccurrences(words);
+    const auto empty = countOccurrences({}, 64);
+
+    CHECK(result == expected);
+    CHECK(defaultGrain == expected);
+    CHECK(empty.empty());
+}
+
+TEST_CASE("FlatStringMap - Insert, find and grow")
+{
+    FlatStringMap<int> map;
+    for (int i = 0; i < 1000; ++i)
+    {
+        map["key" + std::to_string(i % 250)] += i;
+    }
+
+    CHECK(map.size() == 250);
+    REQUIRE(map.find("key7") != nullptr);
+    CHECK(*map.find("key7") == 7 + 257 + 507 + 757);
+    CHECK(map.find("key250") == nullptr);
+
+    const auto [entry, inserted] = map.tryEmplace("key7", 0);
+    CHECK_FALSE(inserted);
+    CHECK(entry.key == "key7");
+
+    int total = 0;
+    map.forEach([&total](std::string_view, int value)
+                { total += value; });
+    CHECK(total == 999 * 1000 / 2);
+}
+
+TEST_CASE("FlatStringMap - Empty map")
+{
+    const FlatStringMap<int> map;
+
+    CHECK(map.size() == 0);
+    CHECK(map.find("anything") == nullptr);
+}
+
 /*
 TEST_CASE("countOccurrences - Basic test")
 {
@@ -387,6 +466,642 @@ TEST_CASE("processChapters - Empty Book")
     CHECK(result.second.empty());
 }
 
+TEST_CASE("processChapters - Stem matching")
+{
+    const std::vector<std::string> tokenizedBook = {"The", "soldiers", "marched", "CHAPTER", "a", "Peaceful", "garden", "Gardens"};
+    const std::vector<std::string> warTokens = {"soldier", "march"};
+    const std::vector<std::string> peaceTokens = {"garden"};
+
+    const auto exact = processChapters(tokenizedBook, warTokens, peaceTokens);
+    const auto stemmed = processChapters(tokenizedBook, warTokens, peaceTokens, MatchMode::Stem);
+
+    CHECK(exact.first[0] == 0.0);
+    CHECK(exact.second[1] == 1.0 / 5);
+
+    CHECK(stemmed.first[0] == 2.0 / 3);
+    CHECK(stemmed.second[1] == 2.0 / 5);
+}
+
+TEST_CASE("HitSpacing - Streaming scan")
+{
+    HitSpacing spacing;
+    for (const bool hit : {false, true, false, false, true, true, false})
+    {
+        spacing.add(hit);
+    }
+
+    CHECK(spacing.hits == 3);
+    CHECK(spacing.firstHit == 1);
+    CHECK(spacing.lastHit == 5);
+    CHECK(spacing.proximityValue() == doctest::Approx(1.0 / 3 + 1.0 / 1));
+    CHECK(spacing.density() == doctest::Approx((3 + 1.0 / 3 + 1.0) / 7));
+}
+
+TEST_CASE("HitSpacing - Combining chunks equals one scan")
+{
+    const std::vector<bool> hits = {true, false, false, true, false, false, false, true, false, true, false, false};
+
+    HitSpacing whole;
+    for (const bool hit : hits)
+    {
+        whole.add(hit);
+    }
+
+    for (size_t split = 0; split <= hits.size(); ++split)
+    {
+        HitSpacing left, right;
+        std::for_each(hits.begin(), hits.begin() + split, [&left](bool hit)
+                      { left.add(hit); });
+        std::for_each(hits.begin() + split, hits.end(), [&right](bool hit)
+                      { right.add(hit); });
+
+        const auto combined = HitSpacing::combine(left, right);
+        CHECK(combined.hits == whole.hits);
+        CHECK(combined.firstHit == whole.firstHit);
+        CHECK(combined.lastHit == whole.lastHit);
+        CHECK(combined.proximity == doctest::Approx(whole.proximity));
+    }
+}
+
+TEST_CASE("calculateDistanceDensity - Parallel chunks match sequential scan")
+{
+    std::vector<std::string> words;
+    for (int i = 0; i < 5000; ++i)
+    {
+        words.push_back(i % 7 == 0 || i % 11 == 0 ? "battle" : "field");
+    }
+
+    HitSpacing expected;
+    for (const auto &word : words)
+    {
+        expected.add(word == "battle");
+    }
+
+    CHECK(calculateDistanceDensity(words, {"battle"}, 100) == doctest::Approx(expected.density()));
+    CHECK(calculateDistanceDensity(words, {"battle"}) == doctest::Approx(expected.density()));
+    CHECK(calculateDistanceDensity({}, {"battle"}) == 0.0);
+    CHECK(calculateDistanceDensity(std::vector<std::string>{"a", "b"}, {"battle"}) == 0.0);
+}
+
+TEST_CASE("processChapters - Distance density")
+{
+    const std::vector<std::string> tokenizedBook = {"war", "war", "x", "x", "x", "peace", "x", "x", "peace", "x"};
+
+    const auto result = processChapters(tokenizedBook, {"war"}, {"peace"}, MatchMode::Exact, DensityMode::Distance);
+
+    CHECK(result.first[0] == doctest::Approx((2 + 1.0) / 10));
+    CHECK(result.second[0] == doctest::Approx((2 + 1.0 / 3) / 10));
+}
+
+TEST_CASE("slidingWindowDensity - Matches rescoring every window")
+{
+    std::vector<std::string> tokens;
+    for (int i = 0; i < 3000; ++i)
+    {
+        tokens.push_back(i % 13 == 0 ? "war" : (i % 5 == 0 ? "peace" : "other"));
+    }
+    const auto interned = internTokens(tokens);
+    const auto categories = classifyVocabulary(interned.vocabulary, {"war"}, {"peace"}, MatchMode::Exact);
+
+    for (const auto &[window, stride] : std::vector<std::pair<size_t, size_t>>{{100, 7}, {50, 50}, {40, 90}, {3000, 1}})
+    {
+        const auto series = slidingWindowDensity(interned.ids, categories, window, stride);
+
+        REQUIRE(series.war.size() == (tokens.size() - window) / stride + 1);
+        for (size_t w = 0; w < series.war.size(); ++w)
+        {
+            const auto begin = tokens.begin() + w * stride;
+            CHECK(series.war[w] == doctest::Approx(std::count(begin, begin + window, "war") / static_cast<double>(window)));
+            CHECK(series.peace[w] == doctest::Approx(std::count(begin, begin + window, "peace") / static_cast<double>(window)));
+        }
+    }
+
+    CHECK(slidingWindowDensity(interned.ids, categories, 5000, 10).war.empty());
+}
+
+TEST_CASE("writeDensitySeries - Binary layout")
+{
+    DensitySeries series;
+    series.window = 10;
+    series.stride = 5;
+    series.war = {0.5f, 0.25f};
+    series.peace = {0.0f, 0.125f};
+    const std::string filename = "files/output/testSeries.bin";
+
+    CHECK(std::holds_alternative<Success>(writeDensitySeries(series, filename)));
+
+    std::ifstream file(filename, std::ios::binary);
+    char magic[4];
+    uint32_t version;
+    uint64_t header[3];
+    float values[4];
+    file.read(magic, 4);
+    file.read(reinterpret_cast<char *>(&version), sizeof(version));
+    file.read(reinterpret_cast<char *>(header), sizeof(header));
+    file.read(reinterpret_cast<char *>(values), sizeof(values));
+    file.close();
+    std::remove(filename.c_str());
+
+    CHECK(std::string(magic, 4) == "WPDS");
+    CHECK(version == 1);
+    CHECK(header[0] == 10);
+    CHECK(header[1] == 5);
+    CHECK(header[2] == 2);
+    CHECK(values[1] == 0.25f);
+    CHECK(values[3] == 0.125f);
+}
+
+TEST_CASE("parseOptions - Window and stride")
+{
+    const auto defaults = std::get<Options>(parseOptions({"--window=2000"}));
+    CHECK(defaults.window == 2000);
+    CHECK(defaults.stride == 500);
+
+    const auto explicitStride = std::get<Options>(parseOptions({"--window=100", "--stride=10"}));
+    CHECK(explicitStride.stride == 10);
+
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--window=abc"})));
+}
+
+TEST_CASE("parseOptions - Chunk bytes")
+{
+    CHECK(std::get<Options>(parseOptions({"--chunk-bytes=65536"})).chunkBytes == 65536);
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--chunk-bytes=64k"})));
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--chunk-bytes=4096", "--append"})));
+}
+
+TEST_CASE("HitIndex - Range densities match direct counts")
+{
+    std::vector<std::string> tokens;
+    for (int i = 0; i < 40000; ++i)
+    {
+        tokens.push_back(i % 17 == 0 ? "war" : (i % 6 == 0 ? "peace" : "other"));
+    }
+    const auto interned = internTokens(tokens);
+    const auto categories = classifyVocabulary(interned.vocabulary, {"war"}, {"peace"}, MatchMode::Exact);
+
+    const HitIndex index(interned.ids, categories);
+
+    CHECK(index.size() == tokens.size());
+    for (const auto &[begin, end] : std::vector<std::pair<size_t, size_t>>{{0, 40000}, {123, 20000}, {16383, 16385}, {39999, 40000}})
+    {
+        const auto wars = std::count(tokens.begin() + begin, tokens.begin() + end, "war");
+        const auto peaces = std::count(tokens.begin() + begin, tokens.begin() + end, "peace");
+        CHECK(index.hits(WAR, begin, end) == wars);
+        CHECK(index.density(WAR, begin, end) == static_cast<double>(wars) / (end - begin));
+        CHECK(index.density(PEACE, begin, end) == static_cast<double>(peaces) / (end - begin));
+    }
+
+    CHECK(index.density(WAR, 500, 500) == 0.0);
+    CHECK_THROWS_AS(index.hits(WAR, 10, 40001), std::out_of_range);
+    CHECK(index.hits(PEACE, 0, 40000) == index.hits(PEACE, 0, 20000) + index.hits(PEACE, 20000, 40000));
+    CHECK_THROWS_AS(index.hits(NONE, 0, 10), std::invalid_argument);
+    CHECK_THROWS_AS(index.hits(MARKER, 0, 10), std::invalid_argument);
+}
+
+TEST_CASE("rescoreState - Term edits match a full recompute")
+{
+    const auto book = readFile("files/war_and_peace.txt");
+    const auto warTerms = readFile("files/war_terms.txt");
+    const auto peaceTerms = readFile("files/peace_terms.txt");
+    REQUIRE(std::holds_alternative<std::vector<std::string>>(book));
+
+    const auto bookTokens = tokenizeAll(std::get<std::vector<std::string>>(book));
+    const auto warTokens = tokenizeAll(std::get<std::vector<std::string>>(warTerms));
+    const auto peaceTokens = tokenizeAll(std::get<std::vector<std::string>>(peaceTerms));
+
+    auto interned = internTokens(bookTokens);
+    auto categories = classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, MatchMode::Exact);
+    const auto full = scoreChapters(interned.ids, categories);
+    const auto ids = interned.ids;
+    auto state = buildScoringState(std::move(interned), std::move(categories), MatchMode::Exact, FileFingerprint{1, 2});
+
+    CHECK(stateDensities(state) == full);
+
+    // drop two war terms, add two new ones (one of them also a peace term)
+    auto editedWar = std::vector<std::string>(warTokens.begin() + 2, warTokens.end());
+    editedWar.push_back("Napoleon");
+    editedWar.push_back(peaceTokens.front());
+    auto editedPeace = peaceTokens;
+    editedPeace.push_back("Natasha");
+
+    state = rescoreState(std::move(state), editedWar, editedPeace);
+    const auto editedCategories = classifyVocabulary(state.vocabulary, editedWar, editedPeace, MatchMode::Exact);
+    CHECK(stateDensities(state) == scoreChapters(ids, editedCategories));
+
+    // and back again
+    state = rescoreState(std::move(state), warTokens, peaceTokens);
+    CHECK(stateDensities(state) == full);
+}
+
+TEST_CASE("writeScoringState - Round trip")
+{
+    const auto interned = internTokens({"CHAPTER", "war", "calm", "war", "CHAPTER", "calm"});
+    auto categories = classifyVocabulary(interned.vocabulary, {"war"}, {"calm"}, MatchMode::Exact);
+    const auto state = buildScoringState(internTokens({"CHAPTER", "war", "calm", "war", "CHAPTER", "calm"}), categories, MatchMode::Stem, FileFingerprint{10, 20});
+    const std::string filename = "files/output/testState.bin";
+
+    CHECK(std::holds_alternative<Success>(writeScoringState(state, filename)));
+    auto loaded = readScoringState(filename);
+    std::remove(filename.c_str());
+
+    REQUIRE(std::holds_alternative<ScoringState>(loaded));
+    const auto &restored = std::get<ScoringState>(loaded);
+    CHECK(restored.book == FileFingerprint{10, 20});
+    CHECK(restored.matchMode == MatchMode::Stem);
+    CHECK(restored.vocabulary.size() == 3);
+    CHECK(restored.vocabulary.word(2) == "calm");
+    CHECK(restored.categories == categories);
+    CHECK(restored.postings == state.postings);
+    CHECK(stateDensities(restored) == stateDensities(state));
+
+    CHECK(std::holds_alternative<std::string>(readScoringState("nonexistent.bin")));
+}
+
+TEST_CASE("readScoringState - Corrupt postings are rejected")
+{
+    const auto interned = internTokens({"CHAPTER", "war", "calm", "war", "CHAPTER", "calm"});
+    const auto categories = classifyVocabulary(interned.vocabulary, {"war"}, {"calm"}, MatchMode::Exact);
+    const std::string filename = "files/output/testState.bin";
+    auto roundTrip = [&](const std::function<void(ScoringState &)> &corrupt)
+    {
+        auto state = buildScoringState(internTokens({"CHAPTER", "war", "calm", "war", "CHAPTER", "calm"}), categories, MatchMode::Exact, FileFingerprint{10, 20});
+        corrupt(state);
+        REQUIRE(std::holds_alternative<Success>(writeScoringState(state, filename)));
+        auto loaded = readScoringState(filename);
+        std::remove(filename.c_str());
+        return loaded;
+    };
+
+    CHECK(std::holds_alternative<ScoringState>(roundTrip([](ScoringState &) {})));
+    CHECK(std::holds_alternative<std::string>(roundTrip([](ScoringState &state)
+                                                        { std::swap(state.postingOffsets[1], state.postingOffsets[2]); })));
+    CHECK(std::holds_alternative<std::string>(roundTrip([](ScoringState &state)
+                                                        { state.postings.pop_back(); })));
+    CHECK(std::holds_alternative<std::string>(roundTrip([](ScoringState &state)
+                                                        { state.postings.back().first = static_cast<uint32_t>(state.chapters.size()); })));
+}
+
+TEST_CASE("appendScore - Growing book matches a full recompute")
+{
+    const auto book = readFileRange("files/war_and_peace.txt", 0, 400000);
+    REQUIRE(std::holds_alternative<std::vector<char>>(book));
+    const std::string text(std::get<std::vector<char>>(book).begin(), std::get<std::vector<char>>(book).end());
+    const std::vector<std::string> warTokens = {"war", "soldiers", "battle"};
+    const std::vector<std::string> peaceTokens = {"peace", "love", "ball"};
+    const std::string filename = "files/output/testAppend.txt";
+
+    auto fullChapters = [&](size_t length)
+    {
+        ChapterScan scan;
+        scanText(scan, std::string_view(text).substr(0, length), warTokens, peaceTokens, MatchMode::Exact);
+        return scan.chapters();
+    };
+    auto sameChapters = [](const std::vector<ChapterCounts> &a, const std::vector<ChapterCounts> &b)
+    {
+        return chapterDensities(a, DensityMode::Ratio) == chapterDensities(b, DensityMode::Ratio) &&
+               chapterDensities(a, DensityMode::Distance) == chapterDensities(b, DensityMode::Distance);
+    };
+
+    AppendState state;
+    // grow the file in uneven steps that cut lines and words in half
+    for (const size_t length : {0, 1234, 1300, 150001, 150001, 399999, 400000})
+    {
+        std::ofstream(filename, std::ios::binary) << text.substr(0, length);
+        auto result = appendScore(std::move(state), filename, warTokens, peaceTokens, MatchMode::Exact, DensityMode::Ratio);
+        REQUIRE(std::holds_alternative<std::pair<AppendState, std::vector<ChapterCounts>>>(result));
+        auto &[next, chapters] = std::get<std::pair<AppendState, std::vector<ChapterCounts>>>(result);
+
+        CHECK(next.offset <= length);
+        CHECK(sameChapters(chapters, fullChapters(length)));
+        state = std::move(next);
+    }
+
+    // a term moved from one list to the other invalidates the state: the last war term becomes the first peace term
+    const std::vector<std::string> movedWar = {"war", "soldiers"};
+    const std::vector<std::string> movedPeace = {"battle", "peace", "love", "ball"};
+    CHECK(termsHash(movedWar, movedPeace, MatchMode::Exact, DensityMode::Ratio) != termsHash(warTokens, peaceTokens, MatchMode::Exact, DensityMode::Ratio));
+    auto moved = appendScore(state, filename, movedWar, movedPeace, MatchMode::Exact, DensityMode::Ratio);
+    REQUIRE(std::holds_alternative<std::pair<AppendState, std::vector<ChapterCounts>>>(moved));
+    ChapterScan movedScan;
+    scanText(movedScan, text, movedWar, movedPeace, MatchMode::Exact);
+    CHECK(sameChapters(std::get<std::pair<AppendState, std::vector<ChapterCounts>>>(moved).second, movedScan.chapters()));
+
+    // a rewritten (shorter) file restarts from the beginning
+    std::ofstream(filename, std::ios::binary) << text.substr(0, 5000);
+    auto rewritten = appendScore(std::move(state), filename, warTokens, peaceTokens, MatchMode::Exact, DensityMode::Ratio);
+    REQUIRE(std::holds_alternative<std::pair<AppendState, std::vector<ChapterCounts>>>(rewritten));
+    CHECK(sameChapters(std::get<std::pair<AppendState, std::vector<ChapterCounts>>>(rewritten).second, fullChapters(5000)));
+
+    std::remove(filename.c_str());
+}
+
+TEST_CASE("writeAppendState - Round trip")
+{
+    AppendState state;
+    state.offset = 42;
+    state.prefixHash = 7;
+    state.termsHash = 9;
+    scanText(state.scan, "CHAPTER one war\nCHAPTER two peace war", {"war"}, {"peace"}, MatchMode::Exact);
+    const std::string filename = "files/output/testAppendState.bin";
+
+    CHECK(std::holds_alternative<Success>(writeAppendState(state, filename)));
+    const auto loaded = readAppendState(filename);
+    std::remove(filename.c_str());
+
+    REQUIRE(std::holds_alternative<AppendState>(loaded));
+    const auto &restored = std::get<AppendState>(loaded);
+    CHECK(restored.offset == 42);
+    CHECK(restored.prefixHash == 7);
+    CHECK(restored.termsHash == 9);
+    CHECK(restored.scan.closed.size() == state.scan.closed.size());
+    CHECK(restored.scan.open.warHits == 1);
+    CHECK(restored.scan.open.words == 4);
+}
+
+TEST_CASE("scoreChunked - Any byte chunking matches the sequential scan")
+{
+    const auto size = fileFingerprint("files/war_and_peace.txt");
+    REQUIRE(std::holds_alternative<FileFingerprint>(size));
+    const auto book = readFileRange("files/war_and_peace.txt", 0, std::get<FileFingerprint>(size).size);
+    REQUIRE(std::holds_alternative<std::vector<char>>(book));
+    const std::string_view text(std::get<std::vector<char>>(book).data(), std::get<std::vector<char>>(book).size());
+    const std::vector<std::string> warTokens = {"war", "soldiers", "battle", "CHAPTER"};
+    const std::vector<std::string> peaceTokens = {"peace", "love", "ball", ""};
+    const TermClassifier classifier(warTokens, peaceTokens, MatchMode::Exact);
+
+    auto sequential = [&](std::string_view part)
+    {
+        ChapterScan scan;
+        scanText(scan, part, warTokens, peaceTokens, MatchMode::Exact);
+        return scan.chapters();
+    };
+    auto check = [](const std::vector<ChapterCounts> &actual, const std::vector<ChapterCounts> &expected)
+    {
+        REQUIRE(actual.size() == expected.size());
+        for (size_t i = 0; i < actual.size(); ++i)
+        {
+            CHECK(actual[i].words == expected[i].words);
+            CHECK(actual[i].warHits == expected[i].warHits);
+            CHECK(actual[i].peaceHits == expected[i].peaceHits);
+            CHECK(actual[i].warSpacing.lastHit == expected[i].warSpacing.lastHit);
+            CHECK(actual[i].peaceSpacing.proximity == doctest::Approx(expected[i].peaceSpacing.proximity));
+        }
+    };
+
+    const auto expected = sequential(text);
+    for (const size_t chunkSize : {4093, 65536, 1 << 20, 1 << 23})
+    {
+        check(scoreChunked(text, classifier, chunkSize), expected);
+    }
+
+    // tiny chunks cut every token and line break
+    const auto prefix = text.substr(0, 60000);
+    const auto expectedPrefix = sequential(prefix);
+    for (const size_t chunkSize : {1, 2, 7})
+    {
+        check(scoreChunked(prefix, classifier, chunkSize), expectedPrefix);
+    }
+
+    CHECK(scoreChunked("", classifier, 16).empty());
+}
+
+TEST_CASE("ChapterPieces - Marker right after a marker does not split")
+{
+    const TermClassifier classifier({"war"}, {}, MatchMode::Exact);
+    for (const std::string text : {"CHAPTER CHAPTER war x CHAPTER y", "a CHAPTER war\n CHAPTER", " CHAPTER\nCHAPTER\n\nCHAPTER"})
+    {
+        ChapterScan expected;
+        scanText(expected, text, {"war"}, {}, MatchMode::Exact);
+
+        for (size_t split = 0; split <= text.size(); ++split)
+        {
+            const auto left = summarizeChunk(std::string_view(text).substr(0, split), classifier);
+            const auto right = summarizeChunk(std::string_view(text).substr(split), classifier);
+            const auto lineBreak = summarizeChunk("\n", classifier);
+            const auto whole = combineChunks(combineChunks(lineBreak, combineChunks(left, right, classifier), classifier), lineBreak, classifier);
+
+            ChapterScan scan;
+            scanPieces(scan, whole.tokens);
+            const auto chapters = scan.chapters();
+            REQUIRE(chapters.size() == expected.chapters().size());
+            for (size_t i = 0; i < chapters.size(); ++i)
+            {
+                CHECK(chapters[i].words == expected.chapters()[i].words);
+                CHECK(chapters[i].warHits == expected.chapters()[i].warHits);
+            }
+        }
+    }
+}
+
+TEST_CASE("internTokens - Dense ids in first-seen order")
+{
+    const std::vector<std::string> tokens = {"the", "war", "the", "peace", "war"};
+
+    const auto result = internTokens(tokens);
+
+    CHECK(result.ids == std::vector<uint32_t>{0, 1, 0, 2, 1});
+    CHECK(result.vocabulary.size() == 3);
+    CHECK(result.vocabulary.word(2) == "peace");
+}
+
+TEST_CASE("internWords - Parallel partitions give the ids of a sequential scan")
+{
+    std::vector<std::string> words;
+    uint64_t state = 5;
+    for (int i = 0; i < 20000; ++i)
+    {
+        state = mixHash(state);
+        words.push_back("word" + std::to_string(state % (i < 10000 ? 50 : 3000)));
+    }
+
+    std::unordered_map<std::string, uint32_t> firstSeen;
+    std::vector<uint32_t> expected;
+    for (const auto &word : words)
+    {
+        expected.push_back(firstSeen.emplace(word, static_cast<uint32_t>(firstSeen.size())).first->second);
+    }
+
+    for (const size_t grainSize : {1, 7, 4096, 100000})
+    {
+        const auto result = internWords(words, grainSize);
+
+        CHECK(result.ids == expected);
+        CHECK(result.vocabulary.size() == firstSeen.size());
+        CHECK(result.vocabulary.word(expected.back()) == words.back());
+    }
+    CHECK(internWords({}, 16).ids.empty());
+}
+
+TEST_CASE("stemWord - Inflection suffixes")
+{
+    CHECK(stemWord("soldiers") == "soldier");
+    CHECK(stemWord("soldier") == "soldier");
+    CHECK(stemWord("armies") == "army");
+    CHECK(stemWord("marches") == "march");
+    CHECK(stemWord("fighting") == "fight");
+    CHECK(stemWord("killed") == "kill");
+    CHECK(stemWord("peace") == "peace");
+    CHECK(stemWord("distress") == "distress");
+}
+
+TEST_CASE("countIdOccurrences - Dense counts")
+{
+    const std::vector<uint32_t> ids = {0, 1, 0, 2, 1, 0};
+
+    CHECK(countIdOccurrences(ids, 4) == std::vector<uint32_t>{3, 2, 1, 0});
+    CHECK(countIdOccurrences({}, 2) == std::vector<uint32_t>{0, 0});
+    CHECK(countIdOccurrences(ids, 4, 1) == std::vector<uint32_t>{3, 2, 1, 0});
+}
+
+TEST_CASE("ChapterHistogram - Reset clears touched entries only")
+{
+    ChapterHistogram histogram(5);
+    histogram.add(3);
+    histogram.add(1);
+    histogram.add(3);
+
+    using Entries = std::vector<std::pair<uint32_t, uint32_t>>;
+    CHECK(histogram.entries() == Entries{{3, 2}, {1, 1}});
+
+    histogram.reset();
+    CHECK(histogram.entries().empty());
+    CHECK(histogram.count(3) == 0);
+
+    histogram.add(4);
+    CHECK(histogram.entries() == Entries{{4, 1}});
+}
+
+TEST_CASE("chapterHistograms - Split at chapter markers")
+{
+    const auto interned = internTokens({"CHAPTER", "war", "peace", "war", "CHAPTER", "peace"});
+    const auto categories = classifyVocabulary(interned.vocabulary, {"war"}, {"peace"}, MatchMode::Exact);
+
+    const auto result = chapterHistograms(interned.ids, categories);
+
+    using Entries = std::vector<std::pair<uint32_t, uint32_t>>;
+    REQUIRE(result.size() == 3);
+    CHECK(result[0].empty());
+    CHECK(result[1] == Entries{{0, 1}, {1, 2}, {2, 1}});
+    CHECK(result[2] == Entries{{0, 1}, {2, 1}});
+}
+
+TEST_CASE("classifyVocabulary - Exact and stem modes")
+{
+    const auto interned = internTokens({"soldiers", "CHAPTER", "calm", "Calm", "other"});
+    const std::vector<std::string> warTokens = {"soldier", "calm"};
+    const std::vector<std::string> peaceTokens = {"calm"};
+
+    const auto exact = classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, MatchMode::Exact);
+    const auto stemmed = classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, MatchMode::Stem);
+
+    CHECK(exact == std::vector<uint8_t>{NONE, MARKER, WAR | PEACE, NONE, NONE});
+    CHECK(stemmed == std::vector<uint8_t>{WAR, MARKER, WAR | PEACE, WAR | PEACE, NONE});
+}
+
+TEST_CASE("parseOptions - Unknown option")
+{
+    const auto result = parseOptions({"--bogus"});
+
+    CHECK(std::holds_alternative<std::string>(result));
+    CHECK(std::get<std::string>(result) == "Unknown option: --bogus");
+}
+
+TEST_CASE("CountMinSketch - Never undercounts, bounded overcount")
+{
+    CountMinSketch sketch(272, 5); // epsilon = e / 272 ~ 0.01
+    std::unordered_map<std::string, uint32_t> exact;
+    for (int i = 0; i < 10000; ++i)
+    {
+        const auto word = "w" + std::to_string((i * i) % 997);
+        sketch.add(word);
+        exact[word]++;
+    }
+
+    CHECK(sketch.total() == 10000);
+    for (const auto &[word, count] : exact)
+    {
+        CHECK(sketch.estimate(word) >= count);
+        CHECK(sketch.estimate(word) <= count + 0.01 * 10000);
+    }
+}
+
+TEST_CASE("HyperLogLog - Distinct count within error bound")
+{
+    HyperLogLog hll(12); // ~1.6% standard error
+    for (int i = 0; i < 50000; ++i)
+    {
+        hll.add("word" + std::to_string(i % 20000));
+    }
+
+    CHECK(hll.estimate() == doctest::Approx(20000).epsilon(0.05));
+
+    hll.reset();
+    CHECK(hll.estimate() == 0.0);
+}
+
+TEST_CASE("SpaceSaving - Heavy hitters are reported")
+{
+    SpaceSaving frequent(8);
+    for (int i = 0; i < 3000; ++i)
+    {
+        frequent.add(i % 3 == 0 ? "the" : (i % 5 == 0 ? "and" : "rare" + std::to_string(i)));
+    }
+
+    const auto top = frequent.top();
+    REQUIRE(top.size() == 8);
+    CHECK(top[0].word == "the");
+    CHECK(top[0].count - top[0].error <= 1000);
+    CHECK(top[0].count >= 1000);
+    CHECK(top[1].word == "and");
+}
+
+TEST_CASE("SpaceSaving - Exact while every word has a counter")
+{
+    SpaceSaving frequent(4);
+    for (const auto *word : {"b", "a", "c", "a", "b", "a", "d", "c", "a"})
+    {
+        frequent.add(word);
+    }
+
+    const auto top = frequent.top();
+
+    REQUIRE(top.size() == 4);
+    CHECK(top[0].word == "a");
+    CHECK(top[0].count == 4);
+    CHECK(top[1].word == "b");
+    CHECK(top[1].count == 2);
+    CHECK(top[2].word == "c");
+    CHECK(top[2].count == 2);
+    CHECK(top[3].word == "d");
+    CHECK(top[3].error == 0);
+}
+
+TEST_CASE("processChaptersApprox - Agrees with exact categorizations on War and Peace")
+{
+    const auto book = readFile("files/war_and_peace.txt");
+    const auto warTerms = readFile("files/war_terms.txt");
+    const auto peaceTerms = readFile("files/peace_terms.txt");
+    REQUIRE(std::holds_alternative<std::vector<std::string>>(book));
+
+    const auto bookTokens = tokenizeAll(std::get<std::vector<std::string>>(book));
+    const auto warTokens = tokenizeAll(std::get<std::vector<std::string>>(warTerms));
+    const auto peaceTokens = tokenizeAll(std::get<std::vector<std::string>>(peaceTerms));
+
+    const auto exact = processChapters(bookTokens, warTokens, peaceTokens);
+    const auto approx = processChaptersApprox(bookTokens, warTokens, peaceTokens);
+
+    const auto exactCategories = categorizeChapters(exact.first, exact.second);
+    const auto approxCategories = categorizeChapters(approx.warDensities, approx.peaceDensities);
+    REQUIRE(approxCategories.size() == exactCategories.size());
+
+    const auto matching = std::inner_product(exactCategories.begin(), exactCategories.end(), approxCategories.begin(), 0, std::plus<>(), std::equal_to<>());
+    CHECK(matching >= 0.95 * exactCategories.size());
+    CHECK(approx.vocabularySizes.size() == exactCategories.size());
+    CHECK(std::none_of(approx.topWords.begin(), approx.topWords.end(), [](const SpaceSaving::Counter &counter)
+                       { return counter.word.empty(); }));
+}
+
 TEST_CASE("categorizeChapters - Basic test")
 {
     const std::vector<double> warDensities = {0.8, 0.5, 0.6, 0.9};
@@ -417,4 +1132,749 @@ TEST_CASE("categorizeChapters - Tie (equal densities)")
 
     const std::vector<std::string> expected = {"peace-related", "peace-related", "peace-related"};
     CHECK(result == expected);
-}
\ No newline at end of file
+}
+
+TEST_CASE("chapterIndex - Parallel slots match the sequential chapter scan")
+{
+    // marker runs, a marker first and a marker last exercise every branch of the split rule
+    std::vector<uint32_t> ids;
+    uint64_t state = 7;
+    for (int i = 0; i < 50000; ++i)
+    {
+        state = mixHash(state);
+        ids.push_back(i == 0 || i == 49999 || state % 97 < 3 ? 0 : static_cast<uint32_t>(1 + state % 3));
+    }
+    const std::vector<uint8_t> categories = {MARKER, WAR, PEACE, NONE};
+
+    ChapterScan scan;
+    for (const auto id : ids)
+    {
+        scan.add(categories[id]);
+    }
+    const auto expected = scan.chapters();
+
+    for (const size_t grainSize : {1, 100, 16384, 1000000})
+    {
+        const auto index = chapterIndex(ids, categories, grainSize);
+        const auto actual = scoreChapterIndex(ids, categories, index);
+        REQUIRE(actual.size() == expected.size());
+        for (size_t c = 0; c < actual.size(); ++c)
+        {
+            CHECK(index[c].second - index[c].first == expected[c].words);
+            CHECK(actual[c].words == expected[c].words);
+            CHECK(actual[c].warHits == expected[c].warHits);
+            CHECK(actual[c].peaceHits == expected[c].peaceHits);
+            CHECK(actual[c].warSpacing.proximity == expected[c].warSpacing.proximity);
+        }
+    }
+
+    CHECK(chapterIndex({}, categories).empty());
+}
+
+TEST_CASE("ExecMode - Every stage gives the same result under every policy")
+{
+    const auto book = readFile("files/war_and_peace.txt");
+    REQUIRE(std::holds_alternative<std::vector<std::string>>(book));
+    const auto &lines = std::get<std::vector<std::string>>(book);
+    const std::vector<std::string> warTokens = {"war", "soldiers", "battle"};
+    const std::vector<std::string> peaceTokens = {"peace", "love", "ball"};
+
+    const auto tokens = tokenizeAll(lines);
+    const auto interned = internTokens(tokens);
+    const auto categories = classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, MatchMode::Stem);
+    const auto densities = scoreChapters(interned.ids, categories, DensityMode::Distance, ExecMode::Seq);
+    const auto labels = categorizeChapters(densities.first, densities.second);
+
+    for (const auto exec : {ExecMode::Seq, ExecMode::Par, ExecMode::ParUnseq})
+    {
+        CHECK(tokenizeAll(lines, exec) == tokens);
+        CHECK(classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, MatchMode::Stem, exec) == categories);
+        CHECK(scoreChapters(interned.ids, categories, DensityMode::Distance, exec) == densities);
+        CHECK(categorizeChapters(densities.first, densities.second, exec) == labels);
+    }
+
+    CHECK(tokenizeAll({}, ExecMode::Par).empty());
+    CHECK(tokenizeAll({"", "\r", "a b"}, ExecMode::Par) == tokenizeAll({"", "\r", "a b"}));
+}
+
+TEST_CASE("parseOptions - Execution policy")
+{
+    CHECK(std::get<Options>(parseOptions({})).execMode == ExecMode::Par);
+    CHECK(std::get<Options>(parseOptions({"--exec=seq"})).execMode == ExecMode::Seq);
+    CHECK(std::get<Options>(parseOptions({"--exec=par_unseq"})).execMode == ExecMode::ParUnseq);
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--exec=gpu"})));
+}
+
+TEST_CASE("scorePipelined - Matches the sequential scan for any chunk size and token limit")
+{
+    const auto size = fileFingerprint("files/war_and_peace.txt");
+    REQUIRE(std::holds_alternative<FileFingerprint>(size));
+    const auto book = readFileRange("files/war_and_peace.txt", 0, std::get<FileFingerprint>(size).size);
+    REQUIRE(std::holds_alternative<std::vector<char>>(book));
+    const std::vector<std::string> warTokens = {"war", "soldiers", "battle"};
+    const std::vector<std::string> peaceTokens = {"peace", "love", "ball"};
+    const TermClassifier classifier(warTokens, peaceTokens, MatchMode::Exact);
+
+    ChapterScan scan;
+    scanText(scan, std::string_view(std::get<std::vector<char>>(book).data(), std::get<std::vector<char>>(book).size()), warTokens, peaceTokens, MatchMode::Exact);
+    const auto expected = scan.chapters();
+
+    for (const auto &[chunkBytes, liveChunks] : std::vector<std::pair<size_t, size_t>>{{4093, 1}, {65536, 4}, {1 << 20, 16}, {1 << 23, 2}})
+    {
+        const auto chapters = scorePipelined("files/war_and_peace.txt", classifier, chunkBytes, liveChunks);
+        REQUIRE(std::holds_alternative<std::vector<ChapterCounts>>(chapters));
+        const auto &actual = std::get<std::vector<ChapterCounts>>(chapters);
+        REQUIRE(actual.size() == expected.size());
+        for (size_t c = 0; c < actual.size(); ++c)
+        {
+            CHECK(actual[c].words == expected[c].words);
+            CHECK(actual[c].warHits == expected[c].warHits);
+            CHECK(actual[c].peaceHits == expected[c].peaceHits);
+            CHECK(actual[c].peaceSpacing.proximity == doctest::Approx(expected[c].peaceSpacing.proximity));
+        }
+    }
+
+    CHECK(std::holds_alternative<std::string>(scorePipelined("files/missing.txt", classifier, 4096, 4)));
+}
+
+TEST_CASE("parseOptions - Pipeline")
+{
+    const auto options = std::get<Options>(parseOptions({"--pipeline=8", "--chunk-bytes=4096"}));
+    CHECK(options.pipelineChunks == 8);
+    CHECK(options.chunkBytes == 4096);
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--pipeline=8", "--approx"})));
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--pipeline="})));
+}
+
+TEST_CASE("processChapter - Chapter views into the token storage match the interned scoring")
+{
+    const auto book = readFile("files/war_and_peace.txt");
+    REQUIRE(std::holds_alternative<std::vector<std::string>>(book));
+    const auto tokens = tokenizeAll(std::get<std::vector<std::string>>(book));
+    const std::vector<std::string> warTokens = {"war", "soldiers", "battle"};
+    const std::vector<std::string> peaceTokens = {"peace", "love", "ball"};
+
+    const auto interned = internTokens(tokens);
+    const auto categories = classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, MatchMode::Exact);
+    const auto index = chapterIndex(interned.ids, categories);
+
+    std::vector<double> warDensities;
+    std::vector<double> peaceDensities;
+    warDensities.reserve(index.size());
+    peaceDensities.reserve(index.size());
+    for (const auto &range : index)
+    {
+        const auto chapter = wordSpan(tokens, range);
+        CHECK(chapter.data() == tokens.data() + range.first);
+        processChapter(chapter, warTokens, peaceTokens, warDensities, peaceDensities);
+    }
+
+    CHECK(std::make_pair(warDensities, peaceDensities) == scoreChapters(interned.ids, categories));
+    const auto occurrences = countOccurrences(filterWords(wordSpan(tokens, index[5]), warTokens));
+    CHECK(countTermHits(wordSpan(tokens, index[5]), warTokens) ==
+          std::accumulate(occurrences.begin(), occurrences.end(), size_t{0}, [](size_t sum, const auto &entry)
+                          { return sum + entry.second; }));
+}
+
+TEST_CASE("scoreChapterSpan - Id views score chapters in place")
+{
+    const auto interned = internTokens({"CHAPTER", "war", "calm", "war", "CHAPTER", "calm", "x"});
+    const auto categories = classifyVocabulary(interned.vocabulary, {"war"}, {"calm"}, MatchMode::Exact);
+    const auto index = chapterIndex(interned.ids, categories);
+
+    const auto chapter = idSpan(interned.ids, index.back());
+    const auto result = scoreChapterSpan(chapter, categories);
+
+    CHECK(chapter.data() == interned.ids.data() + 4);
+    CHECK(result.words == 3);
+    CHECK(result.warHits == 0);
+    CHECK(result.peaceHits == 1);
+}
+
+TEST_CASE("findOccurrences - Block scan matches a naive search")
+{
+    std::string text;
+    uint64_t state = 3;
+    for (int i = 0; i < 5000; ++i)
+    {
+        state = mixHash(state);
+        text += "ab\nC"[state % 4];
+    }
+    for (const std::string needle : {"a", "ab", "aba", "C\nC", "abababab", "CHAPTER"})
+    {
+        std::vector<size_t> expected;
+        for (size_t i = 0; i + needle.size() <= text.size(); ++i)
+        {
+            if (text.compare(i, needle.size(), needle) == 0)
+            {
+                expected.push_back(i);
+            }
+        }
+        CHECK(findOccurrences(text, needle) == expected);
+    }
+    CHECK(findOccurrences("aaaaa", "aaa") == std::vector<size_t>{0, 1, 2});
+    CHECK(findOccurrences("ab", "abc").empty());
+    CHECK(findOccurrences("abc", "").empty());
+}
+
+TEST_CASE("buildStructureIndex - Parts and chapters of a small text")
+{
+    const std::string text = "CHAPTER 1\r\nwar in the CHAPTER\r\nCHAPTER 2\r\nBOOK TWO: 1805\r\n\r\nCHAPTER 1\r\npeace\r\nFIRST EPILOGUE: 1813\r\nCHAPTER 1\r\nend";
+    const auto index = buildStructureIndex(text);
+
+    REQUIRE(index.parts.size() == 3);
+    CHECK(index.chapterCount() == 4);
+    CHECK(index.parts[0].title.empty());
+    CHECK(index.parts[1].title == "BOOK TWO: 1805");
+    CHECK(index.parts[2].kind == SectionKind::Epilogue);
+    CHECK(index.parts[0].chapters[0].end == index.parts[0].chapters[1].begin);
+    CHECK(index.parts[0].chapters[1].end == index.parts[1].begin);
+    CHECK(index.parts[2].end == text.size());
+    CHECK(index.find(2, 1)->title == "CHAPTER 1");
+    CHECK(index.find(2, 0) == &index.parts[1]);
+    CHECK(index.find(2, 2) == nullptr);
+    CHECK(index.find(4, 0) == nullptr);
+
+    const auto counts = scoreSection(text, *index.find(1, 1), TermClassifier({"war"}, {"peace"}, MatchMode::Exact));
+    CHECK(counts.words == 6); // CHAPTER 1 war in the CHAPTER
+    CHECK(counts.warHits == 1);
+}
+
+TEST_CASE("buildStructureIndex - War and Peace")
+{
+    const auto book = readWholeFile("files/war_and_peace.txt");
+    REQUIRE(std::holds_alternative<std::vector<char>>(book));
+    const std::string_view text(std::get<std::vector<char>>(book).data(), std::get<std::vector<char>>(book).size());
+    const auto index = buildStructureIndex(text);
+
+    CHECK(index.parts.size() == 17);
+    CHECK(index.chapterCount() == 365);
+    CHECK(index.parts[16].title == "SECOND EPILOGUE");
+    for (const auto &part : index.parts)
+    {
+        for (const auto &chapter : part.chapters)
+        {
+            CHECK(chapter.title.rfind("CHAPTER ", 0) == 0);
+            CHECK(chapter.begin < chapter.end);
+        }
+    }
+
+    // a section scores the same as a scan over its bytes; its heading opens the scan's only non-empty chapter
+    const auto &chapter = *index.find(5, 3);
+    ChapterScan scan;
+    scanText(scan, text.substr(chapter.begin, chapter.end - chapter.begin), {"war"}, {"peace"}, MatchMode::Exact);
+    const auto counts = scoreSection(text, chapter, TermClassifier({"war"}, {"peace"}, MatchMode::Exact));
+    CHECK(counts.words == scan.open.words);
+    CHECK(counts.warHits == scan.open.warHits);
+}
+
+TEST_CASE("parseOptions - Section")
+{
+    const auto part = std::get<Options>(parseOptions({"--section=3"}));
+    CHECK(part.sectionPart == 3);
+    CHECK(part.sectionChapter == 0);
+    const auto chapter = std::get<Options>(parseOptions({"--section=16.2"}));
+    CHECK(chapter.sectionPart == 16);
+    CHECK(chapter.sectionChapter == 2);
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--section=0"})));
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--section=2."})));
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--section=two"})));
+}
+
+TEST_CASE("rollupChapters - Parts, volumes and corpus are merged from chapter counts")
+{
+    const std::string text = "VOLUME I\nCHAPTER 1\nwar\nCHAPTER 2\npeace\nBOOK TWO\nCHAPTER 1\nwar war\nVOLUME II\nFIRST EPILOGUE\nCHAPTER 1\npeace";
+    const auto structure = buildStructureIndex(text);
+    ChapterScan scan;
+    scanText(scan, text, {"war"}, {"peace"}, MatchMode::Exact);
+    const auto chapters = scan.chapters(); // leading chapter + 4
+
+    const auto rollups = rollupChapters(chapters, structure);
+    REQUIRE(std::holds_alternative<std::vector<Rollup>>(rollups));
+    const auto &result = std::get<std::vector<Rollup>>(rollups);
+    REQUIRE(result.size() == 3 + 2 + 1);
+
+    CHECK(result[0].name == "(untitled part)");
+    CHECK(result[0].chapters == 3);
+    CHECK(result[1].name == "BOOK TWO");
+    CHECK(result[1].counts.warHits == 2);
+    CHECK(result[3].name == "VOLUME I");
+    CHECK(result[3].counts.words == result[0].counts.words + result[1].counts.words);
+    CHECK(result[4].name == "VOLUME II");
+    CHECK(result[4].chapters == 1);
+
+    const auto &corpus = result.back();
+    CHECK(corpus.name == "Corpus");
+    CHECK(corpus.chapters == chapters.size());
+    CHECK(corpus.counts.words == scan.open.words + std::accumulate(scan.closed.begin(), scan.closed.end(), size_t{0}, [](size_t sum, const ChapterCounts &c)
+                                                                  { return sum + c.words; }));
+
+    // merged spacing gives the density of the whole text, not an average of chapter densities
+    HitSpacing whole;
+    forEachToken(text, [&whole](std::string_view token)
+                 { whole.add(token == "war"); });
+    CHECK(corpus.counts.warDensity(DensityMode::Distance) == doctest::Approx(whole.density()));
+
+    // a text without volume headings has no volume level
+    const std::string unbound = "CHAPTER 1\nwar\nBOOK TWO\nCHAPTER 1\npeace";
+    ChapterScan unboundScan;
+    scanText(unboundScan, unbound, {"war"}, {"peace"}, MatchMode::Exact);
+    CHECK(std::get<std::vector<Rollup>>(rollupChapters(unboundScan.chapters(), buildStructureIndex(unbound))).size() == 2 + 1);
+
+    // every heading needs exactly one scored chapter, e.g. scores of another book are rejected
+    auto extra = chapters;
+    extra.push_back(ChapterCounts{});
+    CHECK(std::holds_alternative<std::string>(rollupChapters(extra, structure)));
+    CHECK(std::holds_alternative<std::string>(rollupChapters({chapters[0]}, structure)));
+}
+
+TEST_CASE("scoreChaptersScheduled - Both schedules give the chapters of the book-order scorer")
+{
+    std::vector<uint32_t> ids;
+    uint64_t state = 11;
+    for (int i = 0; i < 60000; ++i)
+    {
+        state = mixHash(state);
+        // chapter lengths vary a lot: markers are rare in the first half and frequent in the second
+        const auto markerOdds = i < 30000 ? 2000 : 50;
+        ids.push_back(state % markerOdds == 0 ? 0 : static_cast<uint32_t>(1 + state % 3));
+    }
+    const std::vector<uint8_t> categories = {MARKER, WAR, PEACE, NONE};
+    const auto index = chapterIndex(ids, categories);
+    const auto expected = scoreChapterIndex(ids, categories, index);
+
+    // four threads even on smaller machines; the limit ends with the test
+    tbb::global_control limit(tbb::global_control::max_allowed_parallelism, 4);
+    tbb::task_arena arena(4);
+    for (const auto schedule : {Schedule::Even, Schedule::LongestFirst})
+    {
+        const auto scheduled = arena.execute([&]
+                                             { return scoreChaptersScheduled(ids, categories, index, schedule); });
+        CHECK(scheduled.busyMilliseconds.size() == 4);
+        CHECK(scheduled.imbalance() >= 1.0);
+        CHECK(scheduled.imbalance() <= 4.0);
+        REQUIRE(scheduled.chapters.size() == expected.size());
+        for (size_t c = 0; c < expected.size(); ++c)
+        {
+            CHECK(scheduled.chapters[c].words == expected[c].words);
+            CHECK(scheduled.chapters[c].warHits == expected[c].warHits);
+            CHECK(scheduled.chapters[c].peaceSpacing.proximity == expected[c].peaceSpacing.proximity);
+        }
+    }
+
+    CHECK(scoreChaptersScheduled(ids, categories, {}, Schedule::LongestFirst).chapters.empty());
+}
+
+TEST_CASE("parseOptions - Schedule")
+{
+    CHECK(!std::get<Options>(parseOptions({})).schedule);
+    CHECK(std::get<Options>(parseOptions({"--schedule=longest"})).schedule == Schedule::LongestFirst);
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--schedule=longest", "--pipeline=4"})));
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--schedule=random"})));
+}
+
+TEST_CASE("Deterministic reductions - Output is byte-identical with 1, 2, 7 and 64 threads")
+{
+    const auto book = readFile("files/war_and_peace.txt");
+    const auto bytes = readWholeFile("files/war_and_peace.txt");
+    REQUIRE(std::holds_alternative<std::vector<std::string>>(book));
+    REQUIRE(std::holds_alternative<std::vector<char>>(bytes));
+    const std::string_view text(std::get<std::vector<char>>(bytes).data(), std::get<std::vector<char>>(bytes).size());
+    const std::vector<std::string> warTokens = {"war", "soldiers", "battle", "army"};
+    const std::vector<std::string> peaceTokens = {"peace", "love", "ball", "family"};
+    const TermClassifier classifier(warTokens, peaceTokens, MatchMode::Exact);
+    const auto structure = buildStructureIndex(text);
+
+    // every density and label the parallel paths produce, written with exact (hex) floats
+    auto run = [&]
+    {
+        std::ostringstream out;
+        out << std::hexfloat;
+        auto write = [&out](const std::pair<std::vector<double>, std::vector<double>> &densities)
+        {
+            for (const auto &line : categorizeChapters(densities.first, densities.second))
+            {
+                out << line << ' ';
+            }
+            for (size_t c = 0; c < densities.first.size(); ++c)
+            {
+                out << densities.first[c] << ' ' << densities.second[c] << '\n';
+            }
+        };
+
+        const auto tokens = tokenizeAll(std::get<std::vector<std::string>>(book), ExecMode::Par);
+        const auto interned = internTokens(tokens);
+        const auto categories = classifyVocabulary(interned.vocabulary, warTokens, peaceTokens, MatchMode::Exact, ExecMode::Par);
+        write(scoreChapters(interned.ids, categories, DensityMode::Ratio));
+        write(scoreChapters(interned.ids, categories, DensityMode::Distance, ExecMode::ParUnseq));
+
+        const auto chunked = scoreChunked(text, classifier, 65536);
+        write(chapterDensities(chunked, DensityMode::Distance));
+        write(chapterDensities(std::get<std::vector<ChapterCounts>>(scorePipelined("files/war_and_peace.txt", classifier, 16384, 8)), DensityMode::Distance));
+        const auto rollups = rollupChapters(chunked, structure);
+        for (const auto &rollup : std::get<std::vector<Rollup>>(rollups))
+        {
+            out << rollup.name << ' ' << rollup.counts.warDensity(DensityMode::Distance) << ' ' << rollup.counts.peaceDensity(DensityMode::Distance) << '\n';
+        }
+
+        out << calculateDistanceDensity(tokens, warTokens, 1024) << ' ' << countOccurrences(tokens, 1024).size() << '\n';
+        const auto series = slidingWindowDensity(interned.ids, categories, 1000, 250);
+        for (size_t w = 0; w < series.war.size(); ++w)
+        {
+            out << series.war[w] << ' ' << series.peace[w] << '\n';
+        }
+        return out.str();
+    };
+
+    auto withThreads = [&run](int threads)
+    {
+        tbb::global_control limit(tbb::global_control::max_allowed_parallelism, threads);
+        tbb::task_arena arena(threads);
+        return arena.execute(run);
+    };
+
+    const auto expected = withThreads(1);
+    for (const int threads : {2, 7, 64})
+    {
+        CHECK(withThreads(threads) == expected);
+    }
+
+    // integer spacing state also makes any split of the text agree bit for bit with the sequential scan
+    ChapterScan scan;
+    scanText(scan, text, warTokens, peaceTokens, MatchMode::Exact);
+    CHECK(chapterDensities(scan.chapters(), DensityMode::Distance) == chapterDensities(scoreChunked(text, classifier, 4093), DensityMode::Distance));
+}
+
+TEST_CASE("scoreParagraphs - Blank lines separate units")
+{
+    const TermClassifier classifier({"war"}, {"peace"}, MatchMode::Exact);
+    const std::string text = "CHAPTER 1\r\n\r\n\"war and\r\npeace, war\r\n \r\n\r\n...\r\n\r\npeace\r\n";
+    const auto paragraphs = scoreParagraphs(text, classifier);
+
+    REQUIRE(paragraphs.size() == 3);
+    CHECK(paragraphs[0].words == 2);
+    CHECK(paragraphs[1].words == 4); // the empty token before the quote is not a word
+    CHECK(paragraphs[1].warHits == 2);
+    CHECK(paragraphs[1].peaceHits == 1);
+    CHECK(paragraphs[2].peaceHits == 1); // "..." has no words and opens no unit
+
+    CHECK(scoreParagraphs("", classifier).empty());
+    CHECK(scoreParagraphs("\r\n\r\n", classifier).empty());
+    CHECK(scoreParagraphs("no break", classifier).size() == 1);
+}
+
+TEST_CASE("scoreParagraphs - Piece size does not change the paragraphs")
+{
+    const auto bytes = readWholeFile("files/war_and_peace.txt");
+    REQUIRE(std::holds_alternative<std::vector<char>>(bytes));
+    const std::string_view text(std::get<std::vector<char>>(bytes).data(), std::get<std::vector<char>>(bytes).size());
+    const TermClassifier classifier({"war", "battle"}, {"peace", "love"}, MatchMode::Exact);
+
+    const auto whole = scanParagraphs(text, classifier);
+    size_t words = 0;
+    forEachToken(text, [&words](std::string_view token)
+                 { words += !token.empty(); });
+    CHECK(whole.size() > 10000);
+    CHECK(std::accumulate(whole.begin(), whole.end(), size_t{0}, [](size_t sum, const ChapterCounts &p)
+                          { return sum + p.words; }) == words);
+
+    for (const size_t pieceBytes : {1, 4096, 1 << 18, 1 << 23})
+    {
+        const auto paragraphs = scoreParagraphs(text, classifier, pieceBytes);
+        REQUIRE(paragraphs.size() == whole.size());
+        CHECK(chapterDensities(paragraphs, DensityMode::Distance) == chapterDensities(whole, DensityMode::Distance));
+    }
+}
+
+TEST_CASE("parseOptions - Paragraphs")
+{
+    CHECK(std::get<Options>(parseOptions({"--paragraphs", "--stem", "--density=distance"})).paragraphs);
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--paragraphs", "--rollup"})));
+}
+
+TEST_CASE("Engine - Batch runs reuse the same worker threads")
+{
+    // no parallelism limit of an earlier test may still be active, the engine sets its own
+    REQUIRE(tbb::global_control::active_value(tbb::global_control::max_allowed_parallelism) == static_cast<size_t>(tbb::info::default_concurrency()));
+    Engine engine(EngineConfig{4, {}});
+    CHECK(engine.threads() == 4);
+    CHECK(tbb::global_control::active_value(tbb::global_control::max_allowed_parallelism) == 4);
+
+    // every thread that ever joins one of the engine's arenas
+    std::mutex mutex;
+    std::set<std::thread::id> seen;
+    auto record = [&]
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            seen.insert(std::this_thread::get_id());
+        }
+        // long enough for the workers to wake up and steal, even when they share one CPU with the caller
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    };
+
+    std::vector<uint32_t> ids(200000);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::transform(ids.begin(), ids.end(), ids.begin(), [](uint32_t i)
+                   { return i % 997 == 0 ? 0u : 1u + i % 3; });
+    const std::vector<uint8_t> categories = {MARKER, WAR, PEACE, NONE};
+    const auto expected = scoreChapters(ids, categories);
+
+    for (int book = 0; book < 20; ++book)
+    {
+        const auto densities = engine.run([&]
+                                          {
+                                              tbb::parallel_for(tbb::blocked_range<size_t>(0, 64, 1), [&](const tbb::blocked_range<size_t> &)
+                                                                { record(); });
+                                              return scoreChapters(ids, categories); },
+                                          book % 2 == 0 ? TaskPriority::High : TaskPriority::Low);
+        CHECK(densities == expected);
+    }
+    CHECK(seen.size() > 1);      // the runs really went parallel
+    CHECK(seen.size() <= 4 + 1); // the pool's workers plus the calling thread, however many books ran
+
+    CHECK_THROWS_AS(engine.run([]
+                               { throw std::runtime_error("stage failed"); }),
+                    std::runtime_error);
+}
+
+TEST_CASE("Engine - Submitted tasks of every priority finish before wait returns")
+{
+    Engine engine(EngineConfig{3, {0}});
+    std::atomic<int> done{0};
+    for (int i = 0; i < 30; ++i)
+    {
+        engine.submit([&done]
+                      { ++done; },
+                      static_cast<TaskPriority>(i % 3));
+    }
+    engine.wait();
+    CHECK(done == 30);
+
+#if defined(__linux__)
+    // only workers are pinned, the thread that calls run() keeps its affinity
+    cpu_set_t before, after;
+    REQUIRE(sched_getaffinity(0, sizeof(before), &before) == 0);
+    engine.run([]
+               { tbb::parallel_for(0, 64, [](int)
+                                   { std::this_thread::sleep_for(std::chrono::microseconds(100)); }); });
+    REQUIRE(sched_getaffinity(0, sizeof(after), &after) == 0);
+    CHECK(CPU_EQUAL(&before, &after));
+#endif
+}
+
+TEST_CASE("parseOptions - Engine")
+{
+    const auto options = std::get<Options>(parseOptions({"--threads=16", "--affinity=0,2,4"}));
+    CHECK(options.engine.threads == 16);
+    CHECK(options.engine.cpus == std::vector<int>{0, 2, 4});
+    CHECK(std::get<Options>(parseOptions({})).engine.threads == 0);
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--affinity=0,,1"})));
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--affinity="})));
+}
+
+TEST_CASE("Profiler - Scoped timers sum calls and times per stage, nothing while disabled")
+{
+    auto &profiler = Profiler::global();
+    profiler.reset();
+    tokenizeAll({"War and Peace"});
+    CHECK(profiler.totals().empty());
+
+    profiler.enable();
+    tokenizeAll({"War and Peace"});
+    tokenizeAll({"War and Peace"}, ExecMode::Par);
+    profiler.enable(false);
+    tokenizeAll({"War and Peace"});
+
+    const auto totals = profiler.totals();
+    REQUIRE(totals.count("tokenizeAll") == 1);
+    CHECK(totals.at("tokenizeAll").calls == 2);
+    CHECK(totals.at("tokenizeAll").wallMilliseconds >= 0);
+    CHECK(totals.at("tokenizeAll").cpuMilliseconds >= 0);
+    profiler.reset();
+    CHECK(profiler.totals().empty());
+}
+
+TEST_CASE("writeProfile - Stages are listed by descending wall time")
+{
+    const std::string filename = "files/output/testProfile.json";
+    const std::map<std::string, StageTotals> stages = {{"readFile", {1, 2.5, 2.0}}, {"tokenizeAll", {3, 10.0, 9.5}}};
+    REQUIRE(std::holds_alternative<Success>(writeProfile(stages, 20.0, 19.0, filename)));
+
+    std::ifstream file(filename);
+    const std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    CHECK(json == "{\n  \"wallMilliseconds\": 20.000,\n  \"cpuMilliseconds\": 19.000,\n  \"stages\": [\n"
+                  "    {\"name\": \"tokenizeAll\", \"calls\": 3, \"wallMilliseconds\": 10.000, \"cpuMilliseconds\": 9.500},\n"
+                  "    {\"name\": \"readFile\", \"calls\": 1, \"wallMilliseconds\": 2.500, \"cpuMilliseconds\": 2.000}\n  ]\n}\n");
+    std::remove(filename.c_str());
+}
+
+TEST_CASE("parseOptions - Profile")
+{
+    CHECK(std::get<Options>(parseOptions({"--profile=files/output/profile.json"})).profileFile == "files/output/profile.json");
+    CHECK(std::get<Options>(parseOptions({})).profileFile.empty());
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--profile="})));
+}
+
+TEST_CASE("ZipfSampler - Rank frequencies follow the exponent")
+{
+    const ZipfSampler zipf(1000, 1.0);
+    SplitMix random{7};
+    std::vector<size_t> draws(1000);
+    const size_t samples = 400000;
+    for (size_t i = 0; i < samples; ++i)
+    {
+        ++draws[zipf(random)];
+    }
+    // P(rank r) = 1 / ((r + 1) * H(1000)), H(1000) = 7.4855
+    CHECK(draws[0] / static_cast<double>(samples) == doctest::Approx(1 / 7.4855).epsilon(0.03));
+    CHECK(draws[0] / static_cast<double>(draws[1]) == doctest::Approx(2.0).epsilon(0.05));
+    CHECK(draws[0] / static_cast<double>(draws[9]) == doctest::Approx(10.0).epsilon(0.1));
+
+    const ZipfSampler uniform(4, 0.0);
+    std::vector<size_t> flat(4);
+    for (size_t i = 0; i < 40000; ++i)
+    {
+        ++flat[uniform(random)];
+    }
+    CHECK(*std::min_element(flat.begin(), flat.end()) > 9500);
+}
+
+TEST_CASE("syntheticVocabulary and rankedVocabulary - Distinct words without excluded ones")
+{
+    const auto words = syntheticVocabulary(5000, 3, {"war", "peace"});
+    CHECK(words.size() == 5000);
+    CHECK(std::set<std::string>(words.begin(), words.end()).size() == 5000);
+    CHECK(std::find(words.begin(), words.end(), "war") == words.end());
+    CHECK(words == syntheticVocabulary(5000, 3, {"war", "peace"}));
+
+    const auto ranked = rankedVocabulary({"the", "war", "the", "", "CHAPTER", "a", "the", "a", "BOOKS", "war", "war", "war"}, 10, {"war"});
+    CHECK(ranked == std::vector<std::string>{"the", "a"});
+}
+
+TEST_CASE("generateCorpus - The seed alone decides the text, which is cut at a line end within the size")
+{
+    CorpusConfig config;
+    config.chapterWords = 300;
+    config.chaptersPerBook = 4;
+    config.termRate = 0.05;
+    const std::vector<std::string> terms = {"battle", "peace"};
+    const CorpusGenerator generator(config, syntheticVocabulary(2000, config.seed, terms), terms);
+
+    std::ostringstream one, batched;
+    const auto stats = std::get<CorpusStats>(generateCorpus(generator, 200000, one, 1));
+    const auto batchedStats = std::get<CorpusStats>(generateCorpus(generator, 200000, batched, 7));
+    const auto text = one.str();
+    CHECK(text == batched.str());
+    CHECK(stats.chapters == batchedStats.chapters);
+    CHECK(stats.bytes == text.size());
+    CHECK(text.size() <= 200000);
+    CHECK(text.size() > 200000 - 80);
+    CHECK(text.substr(text.size() - 2) == "\r\n");
+
+    config.seed = 2;
+    std::ostringstream reseeded;
+    generateCorpus(CorpusGenerator(config, syntheticVocabulary(2000, config.seed, terms), terms), 200000, reseeded);
+    CHECK(reseeded.str() != text);
+
+    // headings are found by both the scorer and the structure index; words before the first marker form chapter 0
+    const auto structure = buildStructureIndex(text);
+    CHECK(structure.chapterCount() == stats.chapters);
+    CHECK(structure.parts.size() == (stats.chapters + 3) / 4);
+    const auto chapters = scoreChunked(text, TermClassifier({"battle"}, {"peace"}, MatchMode::Exact), 1 << 16);
+    CHECK(chapters.size() == stats.chapters + 1);
+
+    const auto totals = std::accumulate(chapters.begin(), chapters.end(), ChapterCounts{}, [](ChapterCounts sum, const ChapterCounts &chapter)
+                                        { sum.merge(chapter);
+                                          return sum; });
+    CHECK((totals.warHits + totals.peaceHits) / static_cast<double>(totals.words) == doctest::Approx(0.05).epsilon(0.15));
+    CHECK(totals.words / static_cast<double>(stats.chapters) == doctest::Approx(300).epsilon(0.15));
+
+    // generated books have no volumes: one rollup per book plus the corpus
+    const auto rollups = rollupChapters(chapters, structure);
+    REQUIRE(std::holds_alternative<std::vector<Rollup>>(rollups));
+    CHECK(std::get<std::vector<Rollup>>(rollups).size() == structure.parts.size() + 1);
+}
+
+TEST_CASE("parseOptions - Book")
+{
+    CHECK(std::get<Options>(parseOptions({})).bookFile == "files/war_and_peace.txt");
+    CHECK(std::get<Options>(parseOptions({"--book=files/output/corpus.txt"})).bookFile == "files/output/corpus.txt");
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--book="})));
+}
+
+#if defined(FPROG_TRACK_ALLOCATIONS)
+TEST_CASE("AllocationTracker - A scope counts what it allocates, keeps and peaks at")
+{
+    auto &profiler = Profiler::global();
+    profiler.reset();
+    auto early = std::make_unique<std::vector<char>>(4096); // allocated before tracking starts
+    profiler.enable();
+    AllocationTracker::enable();
+    const auto liveAtStart = AllocationTracker::counts().live;
+    std::unique_ptr<std::vector<char>> kept;
+    {
+        const ScopedTimer timer("allocating");
+        {
+            const std::vector<char> temporary(1 << 20);
+            CHECK(temporary.size() == 1 << 20);
+        }
+        kept = std::make_unique<std::vector<char>>(1000);
+    }
+    {
+        const ScopedTimer timer("quiet");
+    }
+    {
+        const ScopedTimer timer("releasing");
+        early.reset();
+    }
+    CHECK(AllocationTracker::counts().live >= liveAtStart);
+    AllocationTracker::enable(false);
+    profiler.enable(false);
+
+    const auto totals = profiler.totals();
+    const auto &allocating = totals.at("allocating");
+    CHECK(allocating.allocations == 3); // the temporary buffer, the kept vector object and its buffer
+    CHECK(allocating.allocatedBytes >= (1 << 20) + 1000);
+    CHECK(allocating.peakBytes >= 1 << 20);
+    CHECK(allocating.liveBytes >= 1000);
+    CHECK(allocating.liveBytes < 1 << 20);
+    CHECK(totals.at("quiet").allocations == 0);
+    CHECK(totals.at("quiet").peakBytes == 0);
+    CHECK(totals.at("releasing").liveBytes == 0); // freeing untracked blocks does not count
+    profiler.reset();
+}
+#endif
+
+TEST_CASE("writeProfile - Allocation fields only with allocation counts")
+{
+    const std::string filename = "files/output/testProfile.json";
+    StageTotals stage{2, 4.0, 3.0};
+    stage.allocations = 10;
+    stage.allocatedBytes = 640;
+    stage.liveBytes = 32;
+    stage.peakBytes = 512;
+    REQUIRE(std::holds_alternative<Success>(writeProfile({{"countOccurrences", stage}}, 5.0, 4.0, filename, AllocationCounts{12, 700, 64, 600})));
+
+    std::ifstream file(filename);
+    const std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    CHECK(json == "{\n  \"wallMilliseconds\": 5.000,\n  \"cpuMilliseconds\": 4.000,\n  \"allocations\": 12,\n  \"allocatedBytes\": 700,\n  \"peakBytes\": 600,\n"
+                  "  \"stages\": [\n    {\"name\": \"countOccurrences\", \"calls\": 2, \"wallMilliseconds\": 4.000, \"cpuMilliseconds\": 3.000, "
+                  "\"allocations\": 10, \"allocatedBytes\": 640, \"liveBytes\": 32, \"peakBytes\": 512}\n  ]\n}\n");
+    std::remove(filename.c_str());
+}
+
+TEST_CASE("parseOptions - Track allocations")
+{
+    const auto tracked = parseOptions({"--profile=files/output/profile.json", "--track-allocations"});
+    if (AllocationTracker::available)
+    {
+        CHECK(std::get<Options>(tracked).trackAllocations);
+    }
+    else
+    {
+        CHECK(std::holds_alternative<std::string>(tracked)); // nothing would count without the replaced operators
+    }
+    CHECK_FALSE(std::get<Options>(parseOptions({"--profile=files/output/profile.json"})).trackAllocations);
+    CHECK(std::holds_alternative<std::string>(parseOptions({"--track-allocations"})));
+}